@@ -0,0 +1,64 @@
+#include "bench.h"
+
+#include <string.h>
+
+/*
+   The variants of the table we compare:
+
+   - table: the functions of the library.
+   - inline: the inline versions in the header, see the README.
+   - sealed: the functions of the library, on a table sealed into one mapping.
+*/
+
+statepoint_table_t* build_table(void* section, size_t length, float loadFactor) {
+    return generate_table_from_section(section, length, loadFactor);
+}
+
+statepoint_table_t* build_sealed(void* section, size_t length, float loadFactor) {
+    table_options_t options;
+    default_table_options(&options);
+    options.loadFactor = loadFactor;
+    options.sealed = true;
+    return generate_table_with_options(section, length, &options);
+}
+
+uint64_t lookup_all_table(statepoint_table_t* table, uint64_t* keys, uint64_t numKeys) {
+    uint64_t sum = 0;
+    for(uint64_t i = 0; i < numKeys; i++) {
+        frame_info_t* frame = lookup_return_address(table, keys[i]);
+        sum += frame == NULL ? 1 : frame->frameSize;
+    }
+    return sum;
+}
+
+uint64_t lookup_all_inline(statepoint_table_t* table, uint64_t* keys, uint64_t numKeys) {
+    uint64_t sum = 0;
+    for(uint64_t i = 0; i < numKeys; i++) {
+        frame_info_t* frame = lookup_return_address_inline(table, keys[i]);
+        sum += frame == NULL ? 1 : frame->frameSize;
+    }
+    return sum;
+}
+
+backend_t backends[] = {
+    { "table", build_table, lookup_all_table, walk_stack },
+    { "inline", build_table, lookup_all_inline, walk_stack_inline },
+    { "sealed", build_sealed, lookup_all_table, walk_stack }
+};
+
+const int numBackends = sizeof(backends) / sizeof(backend_t);
+
+// whether name is one of the comma separated names, all names being listed when empty.
+bool listed(const char* names, const char* name) {
+    if(names[0] == '\0') {
+        return true;
+    }
+    size_t length = strlen(name);
+    for(const char* cur = names; cur != NULL; cur = strchr(cur, ',')) {
+        cur += *cur == ',';
+        if(strncmp(cur, name, length) == 0 && (cur[length] == ',' || cur[length] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
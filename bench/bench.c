@@ -0,0 +1,362 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L     // for getopt
+#endif
+
+#include "bench.h"
+#include "../src/include/stackmap.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+   Benchmarks the building of tables, lookups and stack walks, for each backend and load
+   factor, over a synthetic stack map whose shape is set by the options below. Results
+   go to stdout as CSV, see counters.c.
+
+   usage: bench [-f functions] [-c callsites per function] [-r max roots per callsite]
+                [-l load factors, comma separated] [-b backends, comma separated]
+                [-s seed]
+*/
+
+typedef struct {
+    uint64_t numFunctions;
+    uint64_t callsitesPerFunction;
+    uint64_t maxRoots;
+    uint64_t seed;
+
+    uint64_t numLookups;
+    uint64_t numStacks;
+    uint64_t stackDepth;
+    uint64_t buildRepeats;
+    uint64_t walkRepeats;
+} bench_config_t;
+
+uint64_t rngState;
+
+uint64_t next_random(void) {
+    // xorshift64
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return rngState;
+}
+
+uint64_t random_below(uint64_t n) {
+    return next_random() % n;
+}
+
+/** Synthetic stack maps **/
+
+#define FIRST_FUNCTION 0x400000
+#define FUNCTION_SPACING 0x1000
+
+void* grow(void* buf, size_t* capacity, size_t needed) {
+    if(needed <= *capacity) {
+        return buf;
+    }
+    while(*capacity < needed) {
+        *capacity = 2 * *capacity + 4096;
+    }
+    buf = realloc(buf, *capacity);
+    assert(buf && "bad alloc");
+    return buf;
+}
+
+value_location_t make_location(uint8_t kind, uint16_t regNum, int32_t offset) {
+    value_location_t loc;
+    memset(&loc, 0, sizeof(loc));
+    loc.kind = kind;
+    loc.locSize = 8;
+    loc.regNum = regNum;
+    loc.offset = offset;
+    return loc;
+}
+
+// Builds a version 3 stack map of statepoints, whose roots are in stack slots
+// relative to the stack pointer, as LLVM 5 encodes them. The return addresses of
+// its callsites are written to keys.
+uint8_t* synthesize_stackmap(bench_config_t* config, size_t* length, uint64_t* keys) {
+    size_t size = sizeof(stackmap_header_t) + config->numFunctions * sizeof(function_info_t);
+    size_t capacity = size;
+    uint8_t* buf = malloc(capacity);
+    assert(buf && "bad alloc");
+
+    stackmap_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.version = 3;
+    header.numFunctions = config->numFunctions;
+    header.numConstants = 0;
+    header.numRecords = config->numFunctions * config->callsitesPerFunction;
+    memcpy(buf, &header, sizeof(header));
+
+    uint64_t numKeys = 0;
+    uint32_t* slotIndices = malloc(config->maxRoots * sizeof(uint32_t));
+    assert(slotIndices && "bad alloc");
+
+    for(uint64_t f = 0; f < config->numFunctions; f++) {
+        function_info_t fn;
+        fn.address = FIRST_FUNCTION + f * FUNCTION_SPACING;
+        fn.stackSize = 8 * (2 + random_below(62));
+        fn.callsiteCount = config->callsitesPerFunction;
+        memcpy(buf + sizeof(stackmap_header_t) + f * sizeof(function_info_t), &fn, sizeof(fn));
+
+        uint64_t numStackSlots = fn.stackSize / 8;
+        uint32_t codeOffset = 0;
+        for(uint64_t c = 0; c < config->callsitesPerFunction; c++) {
+            codeOffset += 5 + random_below(64);
+            keys[numKeys++] = fn.address + codeOffset;
+
+            // distinct slots, the first numBases of which hold base pointers.
+            uint64_t numRoots = random_below(1 + config->maxRoots);
+            if(numRoots > numStackSlots) {
+                numRoots = numStackSlots;
+            }
+            for(uint64_t i = 0; i < numRoots; i++) {
+                uint32_t slot;
+                bool repeated;
+                do {
+                    slot = random_below(numStackSlots);
+                    repeated = false;
+                    for(uint64_t j = 0; j < i; j++) {
+                        repeated = repeated || slotIndices[j] == slot;
+                    }
+                } while(repeated);
+                slotIndices[i] = slot;
+            }
+            uint64_t numBases = numRoots - numRoots / 4;
+
+            uint16_t numLocations = 3 + 2 * numRoots;
+            size_t recordSize = sizeof(callsite_header_t)
+                              + numLocations * sizeof(value_location_t);
+            recordSize = (recordSize + 7) & ~((size_t)0x7);
+            recordSize += 8;    // the liveout header and its padding
+
+            buf = grow(buf, &capacity, size + recordSize);
+            memset(buf + size, 0, recordSize);
+
+            callsite_header_t callsite;
+            callsite.id = next_random();
+            callsite.codeOffset = codeOffset;
+            callsite.flags = 0;
+            callsite.numLocations = numLocations;
+            memcpy(buf + size, &callsite, sizeof(callsite));
+
+            value_location_t* locations = (value_location_t*)(buf + size + sizeof(callsite));
+            for(int i = 0; i < 3; i++) {
+                // calling convention, flags, and no deopt values.
+                value_location_t loc = make_location(Constant, 0, 0);
+                memcpy(locations++, &loc, sizeof(loc));
+            }
+            for(uint64_t i = 0; i < numRoots; i++) {
+                uint32_t base = i < numBases ? slotIndices[i]
+                                             : slotIndices[random_below(numBases)];
+                value_location_t pair[2] = { make_location(Indirect, 7, 8 * base),
+                                             make_location(Indirect, 7, 8 * slotIndices[i]) };
+                memcpy(locations, pair, sizeof(pair));
+                locations += 2;
+            }
+
+            size += recordSize;
+        }
+    }
+
+    free(slotIndices);
+    *length = size;
+    return buf;
+}
+
+/** Synthetic stacks **/
+
+// Lays out depth frames picked at random from the table, as in Figure 1 of api.h,
+// followed by a return address that isn't in the table. Roots point into heap, and
+// their number is added to numRoots.
+uint8_t* synthesize_stack(statepoint_table_t* table, uint64_t* keys, uint64_t numKeys,
+                          uint64_t depth, uint64_t* heap, uint64_t heapWords,
+                          uint64_t* numRoots) {
+    uint64_t* chosen = malloc(depth * sizeof(uint64_t));
+    assert(chosen && "bad alloc");
+
+    size_t size = sizeof(void*);
+    for(uint64_t i = 0; i < depth; i++) {
+        chosen[i] = keys[random_below(numKeys)];
+        size += sizeof(void*) + lookup_return_address(table, chosen[i])->frameSize;
+    }
+
+    uint8_t* stack = calloc(1, size);
+    assert(stack && "bad alloc");
+
+    uint8_t* stackPtr = stack;
+    for(uint64_t i = 0; i < depth; i++) {
+        frame_info_t* frame = lookup_return_address(table, chosen[i]);
+        memcpy(stackPtr, &chosen[i], sizeof(uint64_t));
+        uint8_t* base = stackPtr + sizeof(void*);
+
+        for(uint32_t j = 0; j < frame->numSlots; j++) {
+            uint64_t value;
+            if(frame->slots[j].kind < 0) {
+                value = (uint64_t)(heap + random_below(heapWords));
+                (*numRoots)++;
+            } else {
+                memcpy(&value, base + frame->slots[frame->slots[j].kind].offset, sizeof(value));
+                value += 8;
+            }
+            memcpy(base + frame->slots[j].offset, &value, sizeof(value));
+        }
+
+        stackPtr = base + frame->frameSize;
+    }
+
+    free(chosen);
+    return stack;
+}
+
+void count_root(void** root, void* context) {
+    (void)root;
+    (*(uint64_t*)context)++;
+}
+
+/** Benchmarks **/
+
+volatile uint64_t sink;
+
+void run_backend(bench_config_t* config, backend_t* backend, float loadFactor,
+                 uint8_t* section, size_t length, uint64_t* keys, uint64_t numKeys) {
+    counters_t counters;
+    measurement_t result;
+    counters_open(&counters);
+
+    counters_start(&counters);
+    for(uint64_t i = 0; i < config->buildRepeats; i++) {
+        destroy_table(backend->build(section, length, loadFactor));
+    }
+    counters_stop(&counters, &result);
+    print_result(stdout, "build", backend->name, loadFactor, config->buildRepeats, &result);
+
+    statepoint_table_t* table = backend->build(section, length, loadFactor);
+
+    // the same random sequence for every backend and load factor.
+    rngState = config->seed;
+    uint64_t* lookups = malloc(config->numLookups * sizeof(uint64_t));
+    assert(lookups && "bad alloc");
+    for(uint64_t i = 0; i < config->numLookups; i++) {
+        lookups[i] = keys[random_below(numKeys)];
+    }
+
+    counters_start(&counters);
+    sink = backend->lookup_all(table, lookups, config->numLookups);
+    counters_stop(&counters, &result);
+    print_result(stdout, "lookup_hit", backend->name, loadFactor, config->numLookups, &result);
+
+    // just past a return address is never one.
+    for(uint64_t i = 0; i < config->numLookups; i++) {
+        lookups[i] += 1;
+    }
+
+    counters_start(&counters);
+    sink = backend->lookup_all(table, lookups, config->numLookups);
+    counters_stop(&counters, &result);
+    print_result(stdout, "lookup_miss", backend->name, loadFactor, config->numLookups, &result);
+    free(lookups);
+
+    uint64_t heapWords = 1 << 20;
+    uint64_t* heap = calloc(heapWords, sizeof(uint64_t));
+    uint8_t** stacks = malloc(config->numStacks * sizeof(uint8_t*));
+    assert(heap && stacks && "bad alloc");
+    uint64_t expectedRoots = 0;
+    for(uint64_t i = 0; i < config->numStacks; i++) {
+        stacks[i] = synthesize_stack(table, keys, numKeys, config->stackDepth,
+                                     heap, heapWords, &expectedRoots);
+    }
+
+    uint64_t numRoots = 0;
+    counters_start(&counters);
+    for(uint64_t r = 0; r < config->walkRepeats; r++) {
+        for(uint64_t i = 0; i < config->numStacks; i++) {
+            backend->walk(table, stacks[i], count_root, &numRoots);
+        }
+    }
+    counters_stop(&counters, &result);
+    if(numRoots != config->walkRepeats * expectedRoots) {
+        fprintf(stderr, "bench: the %s walk visited %" PRIu64 " roots rather than %" PRIu64 "\n",
+                backend->name, numRoots, config->walkRepeats * expectedRoots);
+        exit(1);
+    }
+    print_result(stdout, "walk", backend->name, loadFactor,
+                 config->walkRepeats * config->numStacks * config->stackDepth, &result);
+
+    for(uint64_t i = 0; i < config->numStacks; i++) {
+        free(stacks[i]);
+    }
+    free(stacks);
+    free(heap);
+    destroy_table(table);
+    counters_close(&counters);
+}
+
+int main(int argc, char** argv) {
+    bench_config_t config;
+    config.numFunctions = 4096;
+    config.callsitesPerFunction = 4;
+    config.maxRoots = 16;
+    config.seed = 0x5eed;
+    config.numLookups = 1 << 22;
+    config.numStacks = 256;
+    config.stackDepth = 64;
+    config.buildRepeats = 10;
+    config.walkRepeats = 50;
+
+    char loadFactors[256] = "0.5,1,2,4";
+    char backendNames[256] = "";
+
+    int opt;
+    while((opt = getopt(argc, argv, "f:c:r:l:b:s:")) != -1) {
+        switch(opt) {
+            case 'f': config.numFunctions = strtoull(optarg, NULL, 0); break;
+            case 'c': config.callsitesPerFunction = strtoull(optarg, NULL, 0); break;
+            case 'r': config.maxRoots = strtoull(optarg, NULL, 0); break;
+            case 's': config.seed = strtoull(optarg, NULL, 0); break;
+            case 'l': snprintf(loadFactors, sizeof(loadFactors), "%s", optarg); break;
+            case 'b': snprintf(backendNames, sizeof(backendNames), "%s", optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-f functions] [-c callsites] [-r roots] "
+                                "[-l load factors] [-b backends] [-s seed]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(config.numFunctions == 0 || config.callsitesPerFunction == 0 || config.seed == 0) {
+        fprintf(stderr, "bench: need at least one callsite and a nonzero seed\n");
+        return 1;
+    }
+
+    rngState = config.seed;
+    uint64_t numKeys = config.numFunctions * config.callsitesPerFunction;
+    uint64_t* keys = malloc(numKeys * sizeof(uint64_t));
+    assert(keys && "bad alloc");
+    size_t length;
+    uint8_t* section = synthesize_stackmap(&config, &length, keys);
+
+    fprintf(stderr, "bench: %" PRIu64 " callsites in a %zu byte stack map\n", numKeys, length);
+    print_header(stdout);
+
+    char* lfSave = NULL;
+    for(char* lf = strtok_r(loadFactors, ",", &lfSave); lf != NULL;
+        lf = strtok_r(NULL, ",", &lfSave)) {
+        float loadFactor = strtof(lf, NULL);
+        if(loadFactor <= 0) {
+            fprintf(stderr, "bench: bad load factor %s\n", lf);
+            return 1;
+        }
+
+        for(int i = 0; i < numBackends; i++) {
+            if(listed(backendNames, backends[i].name)) {
+                run_backend(&config, backends + i, loadFactor, section, length, keys, numKeys);
+            }
+        }
+    }
+
+    free(section);
+    free(keys);
+    return 0;
+}
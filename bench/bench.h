@@ -0,0 +1,68 @@
+#ifndef __LLVM_STATEPOINT_UTILS_BENCH__
+#define __LLVM_STATEPOINT_UTILS_BENCH__
+
+#include "../dist/llvm-statepoint-tablegen.h"
+
+// for PRIu
+#define __STDC_FORMAT_MACROS 1
+#include <inttypes.h>
+
+/** Hardware counters, see counters.c **/
+
+typedef enum {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_L1D_MISSES,
+    COUNTER_LLC_MISSES,
+    COUNTER_DTLB_MISSES,
+    NUM_COUNTERS
+} counter_kind_t;
+
+typedef struct {
+    int fds[NUM_COUNTERS];      // -1 where the counter is unavailable
+    uint64_t startNanos;
+} counters_t;
+
+typedef struct {
+    uint64_t nanos;
+    bool have[NUM_COUNTERS];
+    uint64_t values[NUM_COUNTERS];
+} measurement_t;
+
+// opens the counters of the calling thread that perf_event_open will give us, and
+// warns once if it gives us none, in which case only the wall time is measured.
+void counters_open(counters_t* counters);
+
+void counters_start(counters_t* counters);
+
+void counters_stop(counters_t* counters, measurement_t* out);
+
+void counters_close(counters_t* counters);
+
+// the results are written as CSV, one row per measurement.
+void print_header(FILE* out);
+
+void print_result(FILE* out, const char* benchmark, const char* backend,
+                  float loadFactor, uint64_t operations, measurement_t* result);
+
+/** Table variants, see backends.c **/
+
+typedef struct {
+    const char* name;
+    statepoint_table_t* (*build)(void* section, size_t length, float loadFactor);
+
+    // looks up each key, returning the sum of the frame sizes found so that the
+    // lookups can't be optimized away.
+    uint64_t (*lookup_all)(statepoint_table_t* table, uint64_t* keys, uint64_t numKeys);
+
+    void (*walk)(statepoint_table_t* table, uint8_t* stackPtr,
+                 root_visitor_t visit, void* context);
+} backend_t;
+
+extern backend_t backends[];
+extern const int numBackends;
+
+// whether name is one of the comma separated names, all names being listed when empty.
+bool listed(const char* names, const char* name);
+
+#endif /* __LLVM_STATEPOINT_UTILS_BENCH__ */
@@ -0,0 +1,168 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // for syscall
+#endif
+
+#include "bench.h"
+
+#include <time.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+const char* counterNames[NUM_COUNTERS] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "dtlb_misses"
+};
+
+uint64_t now_nanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#ifdef __linux__
+
+#define CACHE_READ_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+int open_counter(counter_kind_t kind) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    // the counters are opened separately rather than as a group, so that a missing
+    // one doesn't take the others with it. when there are fewer hardware counters
+    // than these, the kernel multiplexes them and we scale the counts.
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    switch(kind) {
+        case COUNTER_CYCLES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case COUNTER_INSTRUCTIONS:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case COUNTER_L1D_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D);
+            break;
+        case COUNTER_LLC_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL);
+            break;
+        case COUNTER_DTLB_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB);
+            break;
+        default:
+            return -1;
+    }
+
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+#else
+
+int open_counter(counter_kind_t kind) {
+    (void)kind;
+    return -1;
+}
+
+#endif
+
+void counters_open(counters_t* counters) {
+    static bool warned = false;
+
+    bool any = false;
+    for(int i = 0; i < NUM_COUNTERS; i++) {
+        counters->fds[i] = open_counter((counter_kind_t)i);
+        any = any || counters->fds[i] >= 0;
+    }
+
+    if(!any && !warned) {
+        fprintf(stderr, "bench: hardware counters are unavailable, "
+                        "only measuring wall time\n");
+        warned = true;
+    }
+}
+
+void counters_start(counters_t* counters) {
+#ifdef __linux__
+    for(int i = 0; i < NUM_COUNTERS; i++) {
+        if(counters->fds[i] >= 0) {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+    counters->startNanos = now_nanos();
+}
+
+void counters_stop(counters_t* counters, measurement_t* out) {
+    out->nanos = now_nanos() - counters->startNanos;
+
+    for(int i = 0; i < NUM_COUNTERS; i++) {
+        out->have[i] = false;
+        out->values[i] = 0;
+#ifdef __linux__
+        if(counters->fds[i] < 0) {
+            continue;
+        }
+        ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+        // value, time enabled, time running
+        uint64_t data[3];
+        if(read(counters->fds[i], data, sizeof(data)) != sizeof(data) || data[2] == 0) {
+            continue;
+        }
+
+        out->have[i] = true;
+        out->values[i] = data[2] == data[1]
+                       ? data[0]
+                       : (uint64_t)((double)data[0] * data[1] / data[2]);
+#endif
+    }
+}
+
+void counters_close(counters_t* counters) {
+#ifdef __linux__
+    for(int i = 0; i < NUM_COUNTERS; i++) {
+        if(counters->fds[i] >= 0) {
+            close(counters->fds[i]);
+        }
+    }
+#endif
+}
+
+void print_header(FILE* out) {
+    fprintf(out, "benchmark,backend,load_factor,operations,nanos");
+    for(int i = 0; i < NUM_COUNTERS; i++) {
+        fprintf(out, ",%s", counterNames[i]);
+    }
+    fprintf(out, "\n");
+}
+
+// unavailable counters are left empty.
+void print_result(FILE* out, const char* benchmark, const char* backend,
+                  float loadFactor, uint64_t operations, measurement_t* result) {
+    fprintf(out, "%s,%s,%g,%" PRIu64 ",%" PRIu64,
+            benchmark, backend, loadFactor, operations, result->nanos);
+    for(int i = 0; i < NUM_COUNTERS; i++) {
+        if(result->have[i]) {
+            fprintf(out, ",%" PRIu64, result->values[i]);
+        } else {
+            fprintf(out, ",");
+        }
+    }
+    fprintf(out, "\n");
+    fflush(out);
+}
@@ -0,0 +1,148 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L     // for getopt
+#endif
+
+#include "bench.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+   Replays stacks captured with start_capture, see the README: for each backend and
+   load factor, builds a table from the captured stack map, looks up the captured
+   return addresses in the order they were captured, and walks the captured stacks
+   if their frames were captured. Results go to stdout as CSV, see counters.c.
+
+   usage: replay [-l load factors, comma separated] [-b backends, comma separated]
+                 [-n minimum lookups] [-r walk repeats] capture-file
+*/
+
+volatile uint64_t sink;
+
+void count_root(void** root, void* context) {
+    (void)root;
+    (*(uint64_t*)context)++;
+}
+
+void replay_backend(captured_stacks_t* captured, backend_t* backend, float loadFactor,
+                    uint64_t* keys, uint64_t numKeys, uint64_t walkRepeats) {
+    counters_t counters;
+    measurement_t result;
+    counters_open(&counters);
+
+    statepoint_table_t* table = backend->build(captured->section, captured->sectionLength,
+                                               loadFactor);
+    if(table == NULL) {
+        fprintf(stderr, "replay: the captured stack map is malformed\n");
+        exit(1);
+    }
+
+    counters_start(&counters);
+    sink = backend->lookup_all(table, keys, numKeys);
+    counters_stop(&counters, &result);
+    print_result(stdout, "replay_lookup", backend->name, loadFactor, numKeys, &result);
+
+    if(captured->flags & CAPTURE_FRAMES) {
+        uint64_t numFrames = 0;
+        for(uint64_t i = 0; i < captured->numStacks; i++) {
+            numFrames += captured->stacks[i].numFrames;
+        }
+
+        uint64_t numRoots = 0;
+        counters_start(&counters);
+        for(uint64_t r = 0; r < walkRepeats; r++) {
+            for(uint64_t i = 0; i < captured->numStacks; i++) {
+                backend->walk(table, captured->stacks[i].stack, count_root, &numRoots);
+            }
+        }
+        counters_stop(&counters, &result);
+        sink = numRoots;
+        print_result(stdout, "replay_walk", backend->name, loadFactor,
+                     walkRepeats * numFrames, &result);
+    }
+
+    destroy_table(table);
+    counters_close(&counters);
+}
+
+int main(int argc, char** argv) {
+    char loadFactors[256] = "0.5,1,2,4";
+    char backendNames[256] = "";
+    uint64_t minLookups = 1 << 22;
+    uint64_t walkRepeats = 50;
+
+    int opt;
+    while((opt = getopt(argc, argv, "l:b:n:r:")) != -1) {
+        switch(opt) {
+            case 'l': snprintf(loadFactors, sizeof(loadFactors), "%s", optarg); break;
+            case 'b': snprintf(backendNames, sizeof(backendNames), "%s", optarg); break;
+            case 'n': minLookups = strtoull(optarg, NULL, 0); break;
+            case 'r': walkRepeats = strtoull(optarg, NULL, 0); break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if(optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-l load factors] [-b backends] [-n lookups] "
+                        "[-r walk repeats] capture-file\n", argv[0]);
+        return 1;
+    }
+
+    captured_stacks_t* captured = load_captured_stacks(argv[optind]);
+    if(captured == NULL) {
+        fprintf(stderr, "replay: can't read the captured stacks in %s\n", argv[optind]);
+        return 1;
+    }
+    if(captured->sectionLength == 0) {
+        fprintf(stderr, "replay: the stacks were captured without a stack map\n");
+        return 1;
+    }
+
+    // every captured return address in order, repeated until there are enough.
+    uint64_t numCaptured = 0;
+    for(uint64_t i = 0; i < captured->numStacks; i++) {
+        numCaptured += captured->stacks[i].numFrames;
+    }
+    if(numCaptured == 0) {
+        fprintf(stderr, "replay: no frames were captured\n");
+        return 1;
+    }
+
+    uint64_t numKeys = ((minLookups + numCaptured - 1) / numCaptured) * numCaptured;
+    uint64_t* keys = malloc(numKeys * sizeof(uint64_t));
+    assert(keys && "bad alloc");
+    for(uint64_t n = 0; n < numKeys; ) {
+        for(uint64_t i = 0; i < captured->numStacks; i++) {
+            memcpy(keys + n, captured->stacks[i].retAddrs,
+                   captured->stacks[i].numFrames * sizeof(uint64_t));
+            n += captured->stacks[i].numFrames;
+        }
+    }
+
+    fprintf(stderr, "replay: %" PRIu64 " stacks of %" PRIu64 " frames in all\n",
+            captured->numStacks, numCaptured);
+    print_header(stdout);
+
+    char* lfSave = NULL;
+    for(char* lf = strtok_r(loadFactors, ",", &lfSave); lf != NULL;
+        lf = strtok_r(NULL, ",", &lfSave)) {
+        float loadFactor = strtof(lf, NULL);
+        if(loadFactor <= 0) {
+            fprintf(stderr, "replay: bad load factor %s\n", lf);
+            return 1;
+        }
+
+        for(int i = 0; i < numBackends; i++) {
+            if(listed(backendNames, backends[i].name)) {
+                replay_backend(captured, backends + i, loadFactor, keys, numKeys, walkRepeats);
+            }
+        }
+    }
+
+    free(keys);
+    destroy_captured_stacks(captured);
+    return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "include/api.h"
+#include "include/hash_table.h"
+
+#include <pthread.h>
+
+struct table_build {
+    void* section;
+    size_t length;
+    table_options_t options;
+    
+    statepoint_table_t* table;
+    int done;               // only accessed atomically, or with the lock held
+    bool joinable;
+    
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+};
+
+void finish_table_build(table_build_t* build, statepoint_table_t* table) {
+    pthread_mutex_lock(&build->lock);
+    build->table = table;
+    __atomic_store_n(&build->done, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&build->finished);
+    pthread_mutex_unlock(&build->lock);
+}
+
+void* table_build_worker(void* arg) {
+    table_build_t* build = (table_build_t*)arg;
+    statepoint_table_t* table = generate_table_with_options(build->section, build->length, 
+                                                            &build->options);
+    finish_table_build(build, table);
+    return NULL;
+}
+
+table_build_t* start_table_build(void* section, size_t length, table_options_t* options) {
+    table_build_t* build = malloc(sizeof(table_build_t));
+    assert(build && "bad alloc");
+    
+    build->section = section;
+    build->length = length;
+    build->options = *options;
+    build->table = NULL;
+    build->done = 0;
+    pthread_mutex_init(&build->lock, NULL);
+    pthread_cond_init(&build->finished, NULL);
+    
+    build->joinable = pthread_create(&build->thread, NULL, table_build_worker, build) == 0;
+    if(!build->joinable) {
+        // no thread to spare, so the caller pays for the build.
+        table_build_worker(build);
+    }
+    
+    return build;
+}
+
+statepoint_table_t* try_await_table(table_build_t* build) {
+    if(__atomic_load_n(&build->done, __ATOMIC_ACQUIRE)) {
+        return build->table;
+    }
+    return NULL;
+}
+
+statepoint_table_t* await_table(table_build_t* build) {
+    if(__atomic_load_n(&build->done, __ATOMIC_ACQUIRE)) {
+        return build->table;
+    }
+    
+    pthread_mutex_lock(&build->lock);
+    while(!build->done) {
+        pthread_cond_wait(&build->finished, &build->lock);
+    }
+    pthread_mutex_unlock(&build->lock);
+    
+    return build->table;
+}
+
+void destroy_table_build(table_build_t* build) {
+    if(build->joinable) {
+        pthread_join(build->thread, NULL);
+    }
+    pthread_cond_destroy(&build->finished);
+    pthread_mutex_destroy(&build->lock);
+    free(build);
+}
@@ -0,0 +1,502 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // for dl_iterate_phdr
+#endif
+
+#include "include/api.h"
+#include "include/stackmap.h"
+#include "include/hash_table.h"
+
+#include <link.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+   A cached table is a copy of the region of a sealed table (see seal.c), after a
+   header describing where the parts of the table are in it. Return addresses are
+   relative to the load address of the module, so the contents don't depend on where
+   the module is loaded, and the only pointers in them are those into the region
+   itself. When the file can't be mapped at the address the region had when it was
+   written, those pointers are relocated.
+
+   Files are named after the module's build-id and the options, and are replaced
+   atomically with rename, so concurrent runs at worst both build the table. A file
+   may still be truncated or corrupt, so everything lookups read from it is checked
+   before its table is used.
+*/
+
+#define CACHE_MAGIC "SPTABLE"
+#define CACHE_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t pointerSize;
+    uint64_t headerSize;    // the contents start at this offset in the file
+    uint64_t sectionLength;
+    uint64_t optionsHash;
+
+    uint64_t size;
+    uint64_t numIds;
+    uint64_t numStaticRoots;
+    uint64_t numPatchpoints;
+    uint64_t numFunctions;
+
+    // offsets of the parts from the start of the contents
+    uint64_t idsOffset;
+    uint64_t staticRootsOffset;
+    uint64_t patchpointsOffset;
+    uint64_t functionsOffset;
+
+    uint64_t contentSize;
+    uint64_t contentAddress; // where the contents were when the file was written
+} cache_header_t;
+
+// the FNV-1a hash
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    for(size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+#define FNV_OFFSET_BASIS UINT64_C(14695981039346656037)
+
+#define MAX_BUILD_ID 64
+
+typedef struct {
+    uintptr_t address;      // an address within the module we're looking for
+    bool found;
+    uint64_t base;
+    uint8_t buildId[MAX_BUILD_ID];
+    size_t buildIdLength;
+} module_query_t;
+
+void find_build_id(struct dl_phdr_info* info, module_query_t* query) {
+    for(uint16_t i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* phdr = info->dlpi_phdr + i;
+        if(phdr->p_type != PT_NOTE) {
+            continue;
+        }
+
+        uint8_t* cur = (uint8_t*)(info->dlpi_addr + phdr->p_vaddr);
+        uint8_t* end = cur + phdr->p_memsz;
+        while(cur + sizeof(ElfW(Nhdr)) <= end) {
+            ElfW(Nhdr)* note = (ElfW(Nhdr)*)cur;
+            uint8_t* name = cur + sizeof(ElfW(Nhdr));
+            uint8_t* desc = name + ((note->n_namesz + 3) & ~(size_t)0x3);
+            cur = desc + ((note->n_descsz + 3) & ~(size_t)0x3);
+
+            if(note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4
+                    && memcmp(name, "GNU", 4) == 0 && cur <= end
+                    && note->n_descsz <= MAX_BUILD_ID) {
+                memcpy(query->buildId, desc, note->n_descsz);
+                query->buildIdLength = note->n_descsz;
+                return;
+            }
+        }
+    }
+}
+
+int find_module(struct dl_phdr_info* info, size_t size, void* data) {
+    (void)size;
+    module_query_t* query = (module_query_t*)data;
+
+    for(uint16_t i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* phdr = info->dlpi_phdr + i;
+        uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+        if(phdr->p_type == PT_LOAD
+                && query->address >= start && query->address < start + phdr->p_memsz) {
+            query->found = true;
+            query->base = info->dlpi_addr;
+            find_build_id(info, query);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void query_module(void* section, module_query_t* query) {
+    query->address = (uintptr_t)section;
+    query->found = false;
+    query->base = 0;
+    query->buildIdLength = 0;
+    dl_iterate_phdr(find_module, query);
+}
+
+// The section need not be part of a loaded module, e.g. if it was read from a file,
+// in which case the addresses in it are used as they are.
+uint64_t module_key_base(void* section) {
+    module_query_t query;
+    query_module(section, &query);
+    return query.base;
+}
+
+// Hashes the stack maps of the section, with function addresses made relative to
+// the module, since the loader relocates them.
+uint64_t hash_section(void* section, size_t length, uint64_t keyBase) {
+    uint8_t* start = (uint8_t*)section;
+    uint64_t numCallsites;
+    int64_t numBlobs = split_section(start, start + length, NULL, &numCallsites);
+    stackmap_header_t** blobs = malloc((numBlobs + 1) * sizeof(stackmap_header_t*));
+    assert(blobs && "bad alloc");
+    split_section(start, start + length, blobs, &numCallsites);
+
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for(int64_t i = 0; i < numBlobs; i++) {
+        hash = fnv1a(hash, blobs[i], sizeof(stackmap_header_t));
+
+        function_info_t* fn = (function_info_t*)(blobs[i] + 1);
+        for(uint32_t k = 0; k < blobs[i]->numFunctions; k++, fn++) {
+            uint64_t address = fn->address - keyBase;
+            hash = fnv1a(hash, &address, sizeof(uint64_t));
+            hash = fnv1a(hash, &fn->stackSize, sizeof(uint64_t));
+            hash = fnv1a(hash, &fn->callsiteCount, sizeof(uint64_t));
+        }
+
+        uint8_t* rest = (uint8_t*)fn;
+        hash = fnv1a(hash, rest, end_of_blob(blobs[i], NULL) - rest);
+    }
+
+    free(blobs);
+    return hash;
+}
+
+// the options that change the contents of the table
+uint64_t hash_options(table_options_t* options) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    hash = fnv1a(hash, &options->loadFactor, sizeof(float));
+    hash = fnv1a(hash, &options->recordIds, sizeof(bool));
+    hash = fnv1a(hash, &options->statepointIdMask, sizeof(uint64_t));
+    hash = fnv1a(hash, &options->statepointIdValue, sizeof(uint64_t));
+    hash = fnv1a(hash, &options->indexPatchpoints, sizeof(bool));
+    hash = fnv1a(hash, &options->userDataSize, sizeof(uint32_t));
+    
+    // the sizes of functions come from the namer, if there is one. its symbols are
+    // those of the module, which the build-id identifies, so only its presence counts.
+    bool named = options->nameFunction != NULL;
+    hash = fnv1a(hash, &named, sizeof(bool));
+    return hash;
+}
+
+// Returns a malloc'd path to the cached table, and sets keyBase.
+char* cache_path(void* section, size_t length, table_options_t* options,
+                 uint64_t* keyBase) {
+    module_query_t query;
+    query_module(section, &query);
+    *keyBase = query.base;
+
+    uint64_t key;
+    if(query.buildIdLength > 0) {
+        key = fnv1a(FNV_OFFSET_BASIS, query.buildId, query.buildIdLength);
+        // a module could be built with more than one stack map section.
+        uint64_t offset = (uint64_t)section - query.base;
+        key = fnv1a(key, &offset, sizeof(uint64_t));
+    } else {
+        key = hash_section(section, length, query.base);
+    }
+
+    const char* format = "%s/statepoint-%016" PRIx64 "-%016" PRIx64 ".table";
+    uint64_t optionsHash = hash_options(options);
+    int pathLength = snprintf(NULL, 0, format, options->cacheDir, key, optionsHash);
+
+    char* path = malloc(pathLength + 1);
+    assert(path && "bad alloc");
+    snprintf(path, pathLength + 1, format, options->cacheDir, key, optionsHash);
+    return path;
+}
+
+bool valid_cache_header(cache_header_t* header, size_t fileSize, size_t length,
+                        table_options_t* options) {
+    if(fileSize < sizeof(cache_header_t)
+        || memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+        || header->version != CACHE_VERSION
+        || header->pointerSize != sizeof(void*)
+        || header->sectionLength != length
+        || header->optionsHash != hash_options(options)) {
+        return false;
+    }
+
+    // make sure the parts actually fit in the file
+    uint64_t contentSize = header->contentSize;
+    return header->headerSize >= sizeof(cache_header_t)
+        && header->headerSize <= fileSize
+        && contentSize <= fileSize - header->headerSize
+        && header->size > 0
+        && header->size <= contentSize / sizeof(table_bucket_t)
+        && header->idsOffset <= contentSize
+        && header->numIds <= (contentSize - header->idsOffset) / sizeof(id_entry_t)
+        && header->staticRootsOffset <= contentSize
+        && header->numStaticRoots
+            <= (contentSize - header->staticRootsOffset) / sizeof(uint64_t)
+        && header->patchpointsOffset <= contentSize
+        && header->numPatchpoints
+            <= (contentSize - header->patchpointsOffset) / sizeof(patchpoint_info_t*)
+        && header->functionsOffset <= contentSize
+        && header->numFunctions
+            <= (contentSize - header->functionsOffset) / sizeof(function_entry_t);
+}
+
+// Moves the pointers into the region written to the file to where it is now.
+// Returns false if any of them point outside of it.
+bool relocate_contents(statepoint_table_t* table, cache_header_t* header) {
+    uint64_t oldStart = header->contentAddress;
+    uint64_t oldEnd = oldStart + header->contentSize;
+    uint64_t delta = (uint64_t)table->buckets - oldStart;
+
+    for(uint64_t i = 0; i < table->size; i++) {
+        uint64_t entries = (uint64_t)table->buckets[i].entries;
+        if(entries == 0) {
+            continue;
+        }
+        if(entries < oldStart || entries >= oldEnd
+                || table->buckets[i].sizeOfEntries > oldEnd - entries) {
+            return false;
+        }
+        table->buckets[i].entries = (frame_info_t*)(entries + delta);
+    }
+
+    for(uint64_t i = 0; i < table->numIds; i++) {
+        uint64_t frame = (uint64_t)table->ids[i].frame;
+        if(frame < oldStart || frame >= oldEnd) {
+            return false;
+        }
+        table->ids[i].frame = (frame_info_t*)(frame + delta);
+    }
+
+    for(uint64_t i = 0; i < table->numPatchpoints; i++) {
+        uint64_t patchpoint = (uint64_t)table->patchpoints[i];
+        if(patchpoint < oldStart || patchpoint >= oldEnd) {
+            return false;
+        }
+        table->patchpoints[i] = (patchpoint_info_t*)(patchpoint + delta);
+    }
+
+    return true;
+}
+
+// whether the size bytes at p are within the contents.
+bool within_contents(uint8_t* contents, uint64_t contentSize, void* p, uint64_t size) {
+    uintptr_t offset = (uintptr_t)p - (uintptr_t)contents;
+    return (uintptr_t)p >= (uintptr_t)contents && offset <= contentSize
+        && size <= contentSize - offset;
+}
+
+// whether the frame is one generate_table could have written, in the space left for it.
+bool valid_frame(frame_info_t* frame, uint64_t space) {
+    uint16_t knownFlags = FRAME_HAS_ID | (0xFF << FRAME_USER_DATA_SHIFT);
+    if(((uintptr_t)frame & 0x7) != 0 || space < sizeof(frame_info_t)
+        || (frame->flags & ~knownFlags) != 0
+        || statepoint_frame_size(frame) > space) {
+        return false;
+    }
+    
+    // derived pointers are found through the slot of their base.
+    for(uint32_t i = 0; i < frame->numSlots; i++) {
+        if(frame->slots[i].kind >= 0 && (uint32_t)frame->slots[i].kind >= frame->numSlots) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Checks everything lookups read from the file, which may be truncated or corrupt,
+// now that the pointers into the contents have been relocated.
+bool valid_contents(statepoint_table_t* table, uint8_t* contents, uint64_t contentSize) {
+    for(uint64_t i = 0; i < table->size; i++) {
+        table_bucket_t* bucket = table->buckets + i;
+        if(bucket->numEntries == 0) {
+            continue;
+        }
+        if(!within_contents(contents, contentSize, bucket->entries, bucket->sizeOfEntries)) {
+            return false;
+        }
+        
+        // the frames must fill the entries exactly.
+        uint8_t* frame = (uint8_t*)bucket->entries;
+        uint64_t left = bucket->sizeOfEntries;
+        for(uint32_t k = 0; k < bucket->numEntries; k++) {
+            if(!valid_frame((frame_info_t*)frame, left)) {
+                return false;
+            }
+            size_t size = statepoint_frame_size((frame_info_t*)frame);
+            frame += size;
+            left -= size;
+        }
+        if(left != 0) {
+            return false;
+        }
+    }
+    
+    for(uint64_t i = 0; i < table->numIds; i++) {
+        frame_info_t* frame = table->ids[i].frame;
+        if(!within_contents(contents, contentSize, frame, sizeof(frame_info_t))
+            || !valid_frame(frame, contentSize - ((uint8_t*)frame - contents))
+            || !(frame->flags & FRAME_HAS_ID)) {
+            return false;
+        }
+    }
+    
+    for(uint64_t i = 0; i < table->numPatchpoints; i++) {
+        patchpoint_info_t* patchpoint = table->patchpoints[i];
+        if(((uintptr_t)patchpoint & 0x7) != 0
+            || !within_contents(contents, contentSize, patchpoint, sizeof(patchpoint_info_t))
+            || !within_contents(contents, contentSize, patchpoint,
+                                size_of_patchpoint(patchpoint->numValues))) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+// Returns NULL if there is no usable table in the cache.
+statepoint_table_t* load_cached_table(void* section, size_t length,
+                                      table_options_t* options) {
+    uint64_t keyBase;
+    char* path = cache_path(section, length, options, &keyBase);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if(fd < 0) {
+        return NULL;
+    }
+
+    struct stat info;
+    cache_header_t header;
+    if(fstat(fd, &info) != 0
+        || pread(fd, &header, sizeof(cache_header_t), 0) != sizeof(cache_header_t)
+        || !valid_cache_header(&header, info.st_size, length, options)) {
+        close(fd);
+        return NULL;
+    }
+
+    // a private mapping of the file shares its pages with every other process that
+    // maps it, until they are written to. asking for the address the contents had
+    // when they were written usually spares us from writing to them at all.
+    size_t mapSize = info.st_size;
+    void* hint = (void*)(uintptr_t)(header.contentAddress - header.headerSize);
+    uint8_t* region = mmap(hint, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(region == MAP_FAILED) {
+        return NULL;
+    }
+
+    statepoint_table_t* table = malloc(sizeof(statepoint_table_t));
+    assert(table && "bad alloc");
+
+    uint8_t* contents = region + header.headerSize;
+    table->size = header.size;
+    table->buckets = (table_bucket_t*)contents;
+    table->keyBase = keyBase;
+    table->section = section;
+    table->sectionLength = length;
+    table->deopt = NULL;
+    table->numIds = header.numIds;
+    table->ids = (id_entry_t*)(contents + header.idsOffset);
+    table->numStaticRoots = header.numStaticRoots;
+    table->staticRoots = (uint64_t*)(contents + header.staticRootsOffset);
+    table->numPatchpoints = header.numPatchpoints;
+    table->patchpoints = (patchpoint_info_t**)(contents + header.patchpointsOffset);
+    table->numFunctions = header.numFunctions;
+    table->functions = (function_entry_t*)(contents + header.functionsOffset);
+    table->options = *options;
+    table->options.sealed = true;
+    table->region = region;
+    table->regionSize = mapSize;
+
+    if(((uint64_t)contents != header.contentAddress && !relocate_contents(table, &header))
+        || !valid_contents(table, contents, header.contentSize)) {
+        destroy_table(table);
+        return NULL;
+    }
+
+    if(mprotect(region, mapSize, PROT_READ) != 0) {
+        fprintf(stderr, "(statepoint-utils) warning: \
+                         \n\tcouldn't make the cached table read-only!\n");
+    }
+    return table;
+}
+
+static bool write_all(int fd, void* data, size_t size) {
+    uint8_t* cur = (uint8_t*)data;
+    while(size > 0) {
+        ssize_t written = write(fd, cur, size);
+        if(written <= 0) {
+            return false;
+        }
+        cur += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Writes the region of a sealed table to the cache. The table must have been
+// generated from a section with a cacheDir.
+void store_cached_table(statepoint_table_t* table) {
+    assert(table->region != NULL && "only sealed tables can be cached");
+
+    uint64_t keyBase;
+    char* path = cache_path(table->section, table->sectionLength,
+                            &table->options, &keyBase);
+
+    uint8_t* contents = (uint8_t*)table->region;
+
+    // the header takes a whole page, so the contents can be mapped at the same
+    // address they have now, see load_cached_table.
+    long pageSize = sysconf(_SC_PAGESIZE);
+    cache_header_t header;
+    memset(&header, 0, sizeof(cache_header_t));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.pointerSize = sizeof(void*);
+    header.headerSize = pageSize > (long)sizeof(cache_header_t) ?
+                        (uint64_t)pageSize : sizeof(cache_header_t);
+    header.sectionLength = table->sectionLength;
+    header.optionsHash = hash_options(&table->options);
+    header.size = table->size;
+    header.numIds = table->numIds;
+    header.numStaticRoots = table->numStaticRoots;
+    header.numPatchpoints = table->numPatchpoints;
+    header.numFunctions = table->numFunctions;
+    header.idsOffset = (uint8_t*)table->ids - contents;
+    header.staticRootsOffset = (uint8_t*)table->staticRoots - contents;
+    header.patchpointsOffset = (uint8_t*)table->patchpoints - contents;
+    header.functionsOffset = (uint8_t*)table->functions - contents;
+    header.contentSize = table->regionSize;
+    header.contentAddress = (uint64_t)contents;
+
+    uint8_t* headerPage = calloc(header.headerSize, 1);
+    assert(headerPage && "bad alloc");
+    memcpy(headerPage, &header, sizeof(cache_header_t));
+
+    // write to a temporary file first, so no one ever maps a partial table.
+    const char* format = "%s.%ld.tmp";
+    int tmpLength = snprintf(NULL, 0, format, path, (long)getpid());
+    char* tmpPath = malloc(tmpLength + 1);
+    assert(tmpPath && "bad alloc");
+    snprintf(tmpPath, tmpLength + 1, format, path, (long)getpid());
+
+    bool stored = false;
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd >= 0) {
+        stored = write_all(fd, headerPage, header.headerSize)
+              && write_all(fd, contents, table->regionSize);
+        stored = close(fd) == 0 && stored;
+        stored = stored && rename(tmpPath, path) == 0;
+        if(!stored) {
+            unlink(tmpPath);
+        }
+    }
+
+    if(!stored) {
+        fprintf(stderr, "(statepoint-utils) warning: \
+                         \n\tcouldn't write the table to the cache at %s\n", path);
+    }
+
+    free(tmpPath);
+    free(headerPage);
+    free(path);
+}
@@ -0,0 +1,232 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "include/api.h"
+#include "include/hash_table.h"
+
+#include <pthread.h>
+
+/*
+   A capture file holds the stack map of the table the stacks were walked with, so that
+   a replay can build tables from it whose keys are the captured return addresses. All
+   values are in the byte order of the capturing machine, and each part is padded to
+   8 bytes:
+
+     capture_header_t;
+     uint8_t section[sectionLength];
+
+   then, for each captured stack,
+
+     uint64_t numFrames;
+     uint64_t stackSize;        // 0 unless the capture has CAPTURE_FRAMES
+     uint64_t retAddrs[numFrames];
+     uint8_t stack[stackSize];
+*/
+
+#define CAPTURE_MAGIC "SPSTACK"
+#define CAPTURE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;         // capture_flags_t
+    uint64_t sectionLength;
+} capture_header_t;
+
+struct stack_capture {
+    FILE* out;
+    statepoint_table_t* table;
+    uint32_t flags;
+    bool failed;
+
+    // the return addresses of the stack being captured
+    uint64_t* retAddrs;
+    uint64_t capacity;
+
+    pthread_mutex_t lock;
+};
+
+static const uint8_t zeros[8] = { 0 };
+
+size_t padding_to_8(size_t n) {
+    return (8 - (n & 0x7)) & 0x7;
+}
+
+bool write_padded(FILE* out, const void* buf, size_t size) {
+    return fwrite(buf, 1, size, out) == size
+        && fwrite(zeros, 1, padding_to_8(size), out) == padding_to_8(size);
+}
+
+stack_capture_t* start_capture(statepoint_table_t* table, const char* path, uint32_t flags) {
+    FILE* out = fopen(path, "wb");
+    if(out == NULL) {
+        return NULL;
+    }
+
+    capture_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    header.version = CAPTURE_VERSION;
+    header.flags = flags;
+    header.sectionLength = table->section == NULL ? 0 : table->sectionLength;
+
+    if(!write_padded(out, &header, sizeof(header))
+        || !write_padded(out, table->section, header.sectionLength)) {
+        fclose(out);
+        return NULL;
+    }
+
+    stack_capture_t* capture = malloc(sizeof(stack_capture_t));
+    assert(capture && "bad alloc");
+    capture->out = out;
+    capture->table = table;
+    capture->flags = flags;
+    capture->failed = false;
+    capture->retAddrs = NULL;
+    capture->capacity = 0;
+    pthread_mutex_init(&capture->lock, NULL);
+    return capture;
+}
+
+bool capture_stack(stack_capture_t* capture, uint8_t* stackPtr) {
+    pthread_mutex_lock(&capture->lock);
+
+    // the same walk as walk_stack, see Figure 1
+    uint64_t numFrames = 0;
+    uint8_t* cur = stackPtr;
+    frame_info_t* frame = lookup_return_address(capture->table, *(uint64_t*)cur);
+    while(frame != NULL) {
+        if(numFrames == capture->capacity) {
+            capture->capacity = 2 * capture->capacity + 64;
+            capture->retAddrs = realloc(capture->retAddrs, capture->capacity * sizeof(uint64_t));
+            assert(capture->retAddrs && "bad alloc");
+        }
+        capture->retAddrs[numFrames++] = *(uint64_t*)cur;
+
+        cur += sizeof(void*) + frame->frameSize;
+        frame = lookup_return_address(capture->table, *(uint64_t*)cur);
+    }
+
+    // the frames, and the return address that ended the walk.
+    uint64_t stackSize = 0;
+    if(capture->flags & CAPTURE_FRAMES) {
+        stackSize = (cur - stackPtr) + sizeof(void*);
+    }
+
+    uint64_t sizes[2] = { numFrames, stackSize };
+    bool ok = !capture->failed
+           && write_padded(capture->out, sizes, sizeof(sizes))
+           && write_padded(capture->out, capture->retAddrs, numFrames * sizeof(uint64_t))
+           && write_padded(capture->out, stackPtr, stackSize);
+    capture->failed = !ok;
+
+    pthread_mutex_unlock(&capture->lock);
+    return ok;
+}
+
+bool finish_capture(stack_capture_t* capture) {
+    bool ok = !capture->failed;
+    ok = fclose(capture->out) == 0 && ok;
+
+    pthread_mutex_destroy(&capture->lock);
+    free(capture->retAddrs);
+    free(capture);
+    return ok;
+}
+
+bool read_padded(FILE* in, void* buf, size_t size) {
+    uint8_t padding[8];
+    return fread(buf, 1, size, in) == size
+        && fread(padding, 1, padding_to_8(size), in) == padding_to_8(size);
+}
+
+void destroy_captured_stacks(captured_stacks_t* stacks) {
+    for(uint64_t i = 0; i < stacks->numStacks; i++) {
+        free(stacks->stacks[i].retAddrs);
+        free(stacks->stacks[i].stack);
+    }
+    free(stacks->stacks);
+    free(stacks->section);
+    free(stacks);
+}
+
+// Returns the number of bytes left in the file, or -1 if it can't be told.
+int64_t bytes_left(FILE* in) {
+    long pos = ftell(in);
+    if(pos < 0 || fseek(in, 0, SEEK_END) != 0) {
+        return -1;
+    }
+    long end = ftell(in);
+    if(end < pos || fseek(in, pos, SEEK_SET) != 0) {
+        return -1;
+    }
+    return end - pos;
+}
+
+// Returns NULL if the file can't be read or is malformed. Sizes read from the file
+// are checked against what's left of it before anything is allocated for them.
+captured_stacks_t* load_captured_stacks(const char* path) {
+    FILE* in = fopen(path, "rb");
+    if(in == NULL) {
+        return NULL;
+    }
+
+    capture_header_t header;
+    if(!read_padded(in, &header, sizeof(header))
+        || memcmp(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0
+        || header.version != CAPTURE_VERSION) {
+        fclose(in);
+        return NULL;
+    }
+    
+    int64_t left = bytes_left(in);
+    if(left < 0 || header.sectionLength > (uint64_t)left) {
+        fclose(in);
+        return NULL;
+    }
+
+    captured_stacks_t* stacks = calloc(1, sizeof(captured_stacks_t));
+    assert(stacks && "bad alloc");
+    stacks->flags = header.flags;
+    stacks->sectionLength = header.sectionLength;
+    stacks->section = malloc(header.sectionLength + 1);
+    assert(stacks->section && "bad alloc");
+
+    bool ok = read_padded(in, stacks->section, header.sectionLength);
+    uint64_t capacity = 0;
+    uint64_t sizes[2];
+    while(ok && read_padded(in, sizes, sizeof(sizes))) {
+        if(stacks->numStacks == capacity) {
+            capacity = 2 * capacity + 16;
+            stacks->stacks = realloc(stacks->stacks, capacity * sizeof(captured_stack_t));
+            assert(stacks->stacks && "bad alloc");
+        }
+
+        left = bytes_left(in);
+        ok = left >= 0
+            && sizes[0] <= (uint64_t)left / sizeof(uint64_t)
+            && sizes[1] <= (uint64_t)left - sizes[0] * sizeof(uint64_t);
+        if(!ok) {
+            break;
+        }
+
+        captured_stack_t* stack = stacks->stacks + stacks->numStacks++;
+        stack->numFrames = sizes[0];
+        stack->stackSize = sizes[1];
+        stack->retAddrs = malloc(sizes[0] * sizeof(uint64_t) + 1);
+        stack->stack = sizes[1] == 0 ? NULL : malloc(sizes[1]);
+        assert(stack->retAddrs && (sizes[1] == 0 || stack->stack) && "bad alloc");
+
+        ok = read_padded(in, stack->retAddrs, sizes[0] * sizeof(uint64_t))
+          && read_padded(in, stack->stack, sizes[1]);
+    }
+
+    ok = ok && !ferror(in);
+    fclose(in);
+    if(!ok) {
+        destroy_captured_stacks(stacks);
+        return NULL;
+    }
+    return stacks;
+}
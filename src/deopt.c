@@ -0,0 +1,234 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "include/api.h"
+#include "include/stackmap.h"
+#include "include/hash_table.h"
+
+#include <pthread.h>
+
+// serializes the lazy construction of deopt tables. lookups never take it once a
+// table's deopt index has been published.
+static pthread_mutex_t deoptBuildLock = PTHREAD_MUTEX_INITIALIZER;
+
+size_t size_of_deopt(uint32_t numValues) {
+    return sizeof(deopt_info_t) + numValues * sizeof(value_info_t);
+}
+
+deopt_info_t* next_deopt(deopt_info_t* cur) {
+    uint8_t* next = ((uint8_t*)cur) + size_of_deopt(cur->numValues);
+    return (deopt_info_t*)next;
+}
+
+// Converts a stack map location into the frame-relative form used by the tables, where
+// it has one.
+void decode_location(value_location_t* loc, uint64_t frameSize,
+                     uint64_t* constants, uint32_t numConstants, value_info_t* out) {
+    out->size = loc->locSize;
+    out->regNum = loc->regNum;
+
+    switch(loc->kind) {
+        case Register:
+            out->kind = VALUE_IN_REGISTER;
+            out->value = 0;
+            break;
+
+        case Direct:
+            if(frame_relative(loc)) {
+                out->kind = VALUE_FRAME_ADDRESS;
+                out->value = convert_offset(loc, frameSize);
+            } else {
+                out->kind = VALUE_REGISTER_ADDRESS;
+                out->value = loc->offset;
+            }
+            break;
+
+        case Indirect:
+            if(frame_relative(loc)) {
+                out->kind = VALUE_IN_FRAME;
+                out->value = convert_offset(loc, frameSize);
+            } else {
+                out->kind = VALUE_IN_MEMORY;
+                out->value = loc->offset;
+            }
+            break;
+
+        case Constant:
+            out->kind = VALUE_CONSTANT;
+            out->value = loc->offset;
+            break;
+
+        case ConstIndex:
+            if(loc->offset < 0 || (uint32_t)loc->offset >= numConstants) {
+                out->kind = VALUE_UNKNOWN;   // not in the constant pool
+                out->value = 0;
+                break;
+            }
+            out->kind = VALUE_CONSTANT;
+            out->value = (int64_t)constants[loc->offset];
+            break;
+
+        default:
+            // this may run in the middle of a deoptimization, so we carry on.
+            out->kind = VALUE_UNKNOWN;
+            out->value = 0;
+            break;
+    }
+}
+
+// Returns NULL if the callsite has no deopt values.
+deopt_info_t* generate_deopt_info(callsite_header_t* callsite, function_info_t* fn,
+                                  uint64_t* constants, uint32_t numConstants) {
+    int32_t numDeopt;
+    value_location_t* locations = deopt_locations(callsite, &numDeopt);
+
+    if(numDeopt == 0) {
+        return NULL;
+    }
+
+    deopt_info_t* deopt = malloc(size_of_deopt(numDeopt));
+    assert(deopt && "bad alloc");
+
+    deopt->retAddr = fn->address + callsite->codeOffset;
+    deopt->numValues = numDeopt;
+
+    for(int32_t i = 0; i < numDeopt; i++) {
+        decode_location(locations + i, fn->stackSize, constants, numConstants,
+                        deopt->values + i);
+    }
+
+    return deopt;
+}
+
+// Same as insert_key, value is freed.
+void insert_deopt(deopt_table_t* deopt, uint64_t idx, deopt_info_t* value) {
+    deopt_bucket_t* bucket = deopt->buckets + idx;
+    size_t valueSize = size_of_deopt(value->numValues);
+
+    size_t newSize = bucket->sizeOfEntries + valueSize;
+    deopt_info_t* newEntries = realloc(bucket->entries, newSize);
+    assert(newEntries && "bad alloc");
+
+    memcpy(((uint8_t*)newEntries) + bucket->sizeOfEntries, value, valueSize);
+    free(value);
+
+    bucket->entries = newEntries;
+    bucket->sizeOfEntries = newSize;
+    bucket->numEntries += 1;
+}
+
+deopt_table_t* build_deopt_table(statepoint_table_t* table) {
+    deopt_table_t* deopt = malloc(sizeof(deopt_table_t));
+    assert(deopt && "bad alloc");
+
+    deopt->size = table->size;
+    deopt->buckets = calloc(table->size, sizeof(deopt_bucket_t));
+    assert(deopt->buckets && "bad alloc");
+
+    if(table->section == NULL) {
+        return deopt;
+    }
+
+    uint8_t* start = (uint8_t*)table->section;
+    uint8_t* end = start + table->sectionLength;
+
+    // the section was already validated when the table was generated.
+    uint64_t numCallsites;
+    int64_t numBlobs = split_section(start, end, NULL, &numCallsites);
+    stackmap_header_t** blobs = malloc((numBlobs + 1) * sizeof(stackmap_header_t*));
+    assert(blobs && "bad alloc");
+    split_section(start, end, blobs, &numCallsites);
+
+    for(int64_t i = 0; i < numBlobs; i++) {
+        uint64_t* constants = stackmap_constants(blobs[i]);
+
+        callsite_iter_t iter;
+        for(callsite_iter_init(&iter, blobs[i]); iter.remaining > 0;
+                                                 callsite_iter_next(&iter)) {
+            if(!is_statepoint(iter.callsite, &table->options)) {
+                continue;
+            }
+            
+            deopt_info_t* info = generate_deopt_info(iter.callsite, iter.fn, constants,
+                                                     blobs[i]->numConstants);
+            if(info != NULL) {
+                info->retAddr -= table->keyBase;
+                insert_deopt(deopt, computeBucketIndex(table, info->retAddr), info);
+            }
+        }
+    }
+
+    free(blobs);
+    return deopt;
+}
+
+deopt_info_t* lookup_deopt_state(statepoint_table_t* table, uint64_t retAddr) {
+    deopt_table_t* deopt = __atomic_load_n(&table->deopt, __ATOMIC_ACQUIRE);
+
+    if(deopt == NULL) {
+        pthread_mutex_lock(&deoptBuildLock);
+        deopt = table->deopt;
+        if(deopt == NULL) {
+            deopt = build_deopt_table(table);
+            __atomic_store_n(&table->deopt, deopt, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&deoptBuildLock);
+    }
+
+    retAddr -= table->keyBase;
+    deopt_bucket_t bucket = deopt->buckets[computeBucketIndex(table, retAddr)];
+
+    deopt_info_t* entries = bucket.entries;
+    for(uint32_t i = 0; i < bucket.numEntries; i++) {
+        if(entries->retAddr == retAddr) {
+            return entries;
+        }
+        entries = next_deopt(entries);
+    }
+
+    return NULL;
+}
+
+void destroy_deopt_table(deopt_table_t* deopt) {
+    for(uint64_t i = 0; i < deopt->size; i++) {
+        free(deopt->buckets[i].entries);
+    }
+    free(deopt->buckets);
+    free(deopt);
+}
+
+void print_deopt_state(FILE *stream, deopt_info_t* deopt) {
+    fprintf(stream, "\t\treturn address: 0x%" PRIX64 "\n", deopt->retAddr);
+    fprintf(stream, "\t\tnum deopt values: %" PRIu32 "\n", deopt->numValues);
+
+    value_info_t* value = deopt->values;
+    for(uint32_t i = 0; i < deopt->numValues; i++, value++) {
+        fprintf(stream, "\t\tvalue #%" PRIu32 " { size: %" PRIu16 ", ", i, value->size);
+        switch(value->kind) {
+            case VALUE_IN_REGISTER:
+                fprintf(stream, "in register: %" PRIu16 " }\n", value->regNum);
+                break;
+            case VALUE_FRAME_ADDRESS:
+                fprintf(stream, "frame address: %" PRId64 " }\n", value->value);
+                break;
+            case VALUE_IN_FRAME:
+                fprintf(stream, "frame offset: %" PRId64 " }\n", value->value);
+                break;
+            case VALUE_REGISTER_ADDRESS:
+                fprintf(stream, "address: register %" PRIu16 " + %" PRId64 " }\n",
+                        value->regNum, value->value);
+                break;
+            case VALUE_IN_MEMORY:
+                fprintf(stream, "in memory: register %" PRIu16 " + %" PRId64 " }\n",
+                        value->regNum, value->value);
+                break;
+            case VALUE_UNKNOWN:
+                fprintf(stream, "unknown }\n");
+                break;
+            default:
+                fprintf(stream, "constant: %" PRId64 " }\n", value->value);
+                break;
+        }
+    }
+}
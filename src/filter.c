@@ -0,0 +1,300 @@
+#include "include/api.h"
+#include "include/hash_table.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define STATEPOINT_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+/*
+   A minor collection only cares about the roots pointing into the nursery, which are
+   few. So rather than calling the visitor on every base pointer, the bases of a frame
+   are loaded and checked against the ranges 64 at a time, giving a mask of those to
+   visit. With AVX2, four bases are loaded at once with a gather and checked together.
+   Derived pointers are only detached from their bases (see scan_frame_inline) in
+   frames with a root to visit.
+
+   The roots to visit then go through a pipeline of options->prefetchDistance roots:
+   the object a root points to is prefetched as the root joins, and the root is only
+   visited once that many more have joined, so that the object is in the cache by
+   then. The pipeline carries on from frame to frame, so a frame's derived pointers
+   stay detached until its last root has left it.
+*/
+
+typedef uint64_t (*base_matcher_t)(pointer_slot_t* slots, uint32_t count, uint8_t* base,
+                                   const address_range_t* ranges, uint32_t numRanges);
+
+// a frame with roots in the pipeline
+typedef struct {
+    frame_info_t* frame;
+    uint8_t* base;
+    uint32_t numBases;
+    uint32_t numRoots;
+} pending_frame_t;
+
+#define PIPELINE_ROOTS (STATEPOINT_MAX_PREFETCH_DISTANCE + 1)
+#define PIPELINE_FRAMES (STATEPOINT_MAX_PREFETCH_DISTANCE + 2)
+
+typedef struct {
+    root_visitor_t visit;
+    void* context;
+    uint32_t distance;
+    
+    // rings of the roots yet to be visited, oldest first, and of the frames they're in.
+    void** roots[PIPELINE_ROOTS];
+    uint32_t firstRoot;
+    uint32_t numRoots;
+    pending_frame_t frames[PIPELINE_FRAMES];
+    uint32_t firstFrame;
+    uint32_t numFrames;
+    
+    // whether the newest frame is still being scanned, so more roots may join it.
+    bool scanning;
+} root_pipeline_t;
+
+void default_walk_options(walk_options_t* options) {
+    options->ranges = NULL;
+    options->numRanges = 0;
+    options->prefetchDistance = 0;
+}
+
+// every base is visited when there are no ranges.
+uint64_t match_all_bases(pointer_slot_t* slots, uint32_t count, uint8_t* base,
+                         const address_range_t* ranges, uint32_t numRanges) {
+    (void)slots;
+    (void)base;
+    (void)ranges;
+    (void)numRanges;
+    return count == 64 ? ~(uint64_t)0 : ((uint64_t)1 << count) - 1;
+}
+
+// bit i of the result is set if the base pointer of slots[i] is in one of the ranges.
+// count is at most 64.
+uint64_t match_bases_scalar(pointer_slot_t* slots, uint32_t count, uint8_t* base,
+                            const address_range_t* ranges, uint32_t numRanges) {
+    uint64_t mask = 0;
+    for(uint32_t i = 0; i < count; i++) {
+        uintptr_t value = *(uintptr_t*)(base + slots[i].offset);
+        for(uint32_t r = 0; r < numRanges; r++) {
+            if(value - ranges[r].start < ranges[r].end - ranges[r].start) {
+                mask |= (uint64_t)1 << i;
+                break;
+            }
+        }
+    }
+    return mask;
+}
+
+#ifdef STATEPOINT_HAVE_AVX2
+
+__attribute__((target("avx2")))
+uint64_t match_bases_avx2(pointer_slot_t* slots, uint32_t count, uint8_t* base,
+                          const address_range_t* ranges, uint32_t numRanges) {
+    // the offsets are the odd halves of four slots.
+    const __m256i offsetLanes = _mm256_setr_epi32(1, 3, 5, 7, 0, 0, 0, 0);
+
+    // AVX2 only compares signed integers, so both sides have their sign bit flipped.
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+
+    uint64_t mask = 0;
+    uint32_t i = 0;
+    for(; i + 4 <= count; i += 4) {
+        __m256i fourSlots = _mm256_loadu_si256((const __m256i*)(slots + i));
+        __m128i offsets = _mm256_castsi256_si128(
+            _mm256_permutevar8x32_epi32(fourSlots, offsetLanes));
+        __m256i values = _mm256_i32gather_epi64((const long long*)base, offsets, 1);
+
+        // value - start < end - start, as in match_bases_scalar
+        __m256i hits = _mm256_setzero_si256();
+        for(uint32_t r = 0; r < numRanges; r++) {
+            __m256i start = _mm256_set1_epi64x((int64_t)ranges[r].start);
+            __m256i width = _mm256_set1_epi64x((int64_t)(ranges[r].end - ranges[r].start));
+            __m256i distance = _mm256_sub_epi64(values, start);
+            hits = _mm256_or_si256(hits, _mm256_cmpgt_epi64(_mm256_xor_si256(width, sign),
+                                                            _mm256_xor_si256(distance, sign)));
+        }
+        mask |= (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(hits)) << i;
+    }
+
+    if(i < count) {
+        mask |= match_bases_scalar(slots + i, count - i, base, ranges, numRanges) << i;
+    }
+    return mask;
+}
+
+#endif
+
+base_matcher_t pick_base_matcher(const walk_options_t* options) {
+    if(options->numRanges == 0) {
+        return match_all_bases;
+    }
+#ifdef STATEPOINT_HAVE_AVX2
+    if(__builtin_cpu_supports("avx2")) {
+        return match_bases_avx2;
+    }
+#endif
+    return match_bases_scalar;
+}
+
+void init_pipeline(root_pipeline_t* pipeline, root_visitor_t visit, void* context,
+                   const walk_options_t* options) {
+    pipeline->visit = visit;
+    pipeline->context = context;
+    pipeline->distance = options->prefetchDistance < STATEPOINT_MAX_PREFETCH_DISTANCE
+                       ? options->prefetchDistance : STATEPOINT_MAX_PREFETCH_DISTANCE;
+    pipeline->firstRoot = 0;
+    pipeline->numRoots = 0;
+    pipeline->firstFrame = 0;
+    pipeline->numFrames = 0;
+    pipeline->scanning = false;
+}
+
+void retire_oldest_frame(root_pipeline_t* pipeline) {
+    pending_frame_t* oldest = pipeline->frames + pipeline->firstFrame;
+    pointer_slot_t* slots = oldest->frame->slots;
+    for(uint32_t i = oldest->numBases; i < oldest->frame->numSlots; i++) {
+        uintptr_t* derived = (uintptr_t*)(oldest->base + slots[i].offset);
+        *derived += *(uintptr_t*)(oldest->base + slots[slots[i].kind].offset);
+    }
+    
+    pipeline->firstFrame = (pipeline->firstFrame + 1) % PIPELINE_FRAMES;
+    pipeline->numFrames--;
+}
+
+void visit_oldest_root(root_pipeline_t* pipeline) {
+    void** root = pipeline->roots[pipeline->firstRoot];
+    pipeline->firstRoot = (pipeline->firstRoot + 1) % PIPELINE_ROOTS;
+    pipeline->numRoots--;
+    
+    pipeline->visit(root, pipeline->context);
+    STATEPOINT_STAT_ADD(rootsVisited, 1);
+    
+    // the roots leave in the order the frames joined.
+    pending_frame_t* oldest = pipeline->frames + pipeline->firstFrame;
+    oldest->numRoots--;
+    bool open = pipeline->scanning && pipeline->numFrames == 1;
+    if(oldest->numRoots == 0 && !open) {
+        retire_oldest_frame(pipeline);
+    }
+}
+
+void pipeline_frame(root_pipeline_t* pipeline, frame_info_t* frame, uint8_t* base,
+                    const walk_options_t* options, base_matcher_t matcher) {
+    uint32_t numSlots = frame->numSlots;
+    pointer_slot_t* slots = frame->slots;
+    
+    uint32_t numBases = 0;
+    while(numBases < numSlots && slots[numBases].kind < 0) {
+        numBases++;
+    }
+    STATEPOINT_STAT_ADD(framesScanned, 1);
+    
+    // like scan_frame_inline, though the roots found here may be visited later on.
+    bool traced = numSlots >= STATEPOINT_TRACE_LARGE_FRAME;
+    uint64_t start = STATEPOINT_TRACE_START(traced);
+    
+    pending_frame_t* pending = NULL;
+    for(uint32_t first = 0; first < numBases; first += 64) {
+        uint32_t count = numBases - first < 64 ? numBases - first : 64;
+        uint64_t mask = matcher(slots + first, count, base, options->ranges, options->numRanges);
+        if(mask == 0) {
+            continue;
+        }
+        
+        if(pending == NULL) {
+            for(uint32_t i = numBases; i < numSlots; i++) {
+                uintptr_t* derived = (uintptr_t*)(base + slots[i].offset);
+                *derived -= *(uintptr_t*)(base + slots[slots[i].kind].offset);
+            }
+            uint32_t last = (pipeline->firstFrame + pipeline->numFrames) % PIPELINE_FRAMES;
+            pending = pipeline->frames + last;
+            pending->frame = frame;
+            pending->base = base;
+            pending->numBases = numBases;
+            pending->numRoots = 0;
+            pipeline->numFrames++;
+            pipeline->scanning = true;
+        }
+        
+        while(mask != 0) {
+            void** root = (void**)(base + slots[first + __builtin_ctzll(mask)].offset);
+            mask &= mask - 1;
+            
+            if(pipeline->distance > 0) {
+                __builtin_prefetch(*root, 1);
+            }
+            pipeline->roots[(pipeline->firstRoot + pipeline->numRoots) % PIPELINE_ROOTS] = root;
+            pipeline->numRoots++;
+            pending->numRoots++;
+            if(pipeline->numRoots > pipeline->distance) {
+                visit_oldest_root(pipeline);
+            }
+        }
+    }
+    
+    // when the frame has no roots left in the pipeline, neither have the older ones.
+    pipeline->scanning = false;
+    if(pending != NULL && pending->numRoots == 0) {
+        retire_oldest_frame(pipeline);
+    }
+    
+    if(traced) {
+        STATEPOINT_TRACE_EVENT(TRACE_SCAN_FRAME, start, STATEPOINT_CLOCK(), numSlots);
+    }
+    (void)start;
+}
+
+void drain_pipeline(root_pipeline_t* pipeline) {
+    while(pipeline->numRoots > 0) {
+        visit_oldest_root(pipeline);
+    }
+}
+
+void scan_frame_with_options(frame_info_t* frame, uint8_t* base, root_visitor_t visit,
+                             void* context, const walk_options_t* options) {
+    if(options->numRanges == 0 && options->prefetchDistance == 0) {
+        scan_frame_inline(frame, base, visit, context);
+        return;
+    }
+    
+    root_pipeline_t pipeline;
+    init_pipeline(&pipeline, visit, context, options);
+    pipeline_frame(&pipeline, frame, base, options, pick_base_matcher(options));
+    drain_pipeline(&pipeline);
+}
+
+void walk_stack_with_options(statepoint_table_t* table, uint8_t* stackPtr,
+                             root_visitor_t visit, void* context,
+                             const walk_options_t* options) {
+    if(options->numRanges == 0 && options->prefetchDistance == 0) {
+        walk_stack_inline(table, stackPtr, visit, context);
+        return;
+    }
+    
+    uint64_t start = STATEPOINT_CLOCK();
+    uint64_t numFrames = 0;
+    base_matcher_t matcher = pick_base_matcher(options);
+    root_pipeline_t pipeline;
+    init_pipeline(&pipeline, visit, context, options);
+    
+    // see Figure 1
+    frame_info_t* frame = lookup_return_address_inline(table, *(uint64_t*)stackPtr);
+    while(frame != NULL) {
+        uint8_t* base = stackPtr + sizeof(void*);
+        pipeline_frame(&pipeline, frame, base, options, matcher);
+        numFrames++;
+        
+        stackPtr = base + frame->frameSize;
+        frame = lookup_return_address_inline(table, *(uint64_t*)stackPtr);
+    }
+    drain_pipeline(&pipeline);
+    
+    uint64_t end = STATEPOINT_CLOCK();
+    STATEPOINT_STAT_ADD(stacksWalked, 1);
+    STATEPOINT_STAT_ADD(walkNanos, end - start);
+    STATEPOINT_STAT_MAX(maxWalkNanos, end - start);
+    STATEPOINT_TRACE_EVENT(TRACE_WALK_STACK, start, end, numFrames);
+    (void)start;
+    (void)end;
+    (void)numFrames;
+}
@@ -0,0 +1,103 @@
+#include "include/api.h"
+#include "include/hash_table.h"
+
+/*
+   The stack map gives the address of each function with statepoints, but not its
+   size. A function spans at least its last return address, and we assume it runs up
+   to the next function of the same stack map, since LLVM emits a module's functions
+   in order. Where options->nameFunction knows the size of the function's symbol,
+   that is used instead, unless the function's last return address is past it.
+   
+   Functions never overlap in the index, except that a function ending in a call keeps
+   its last return address when the next function starts right there. A return address
+   is never the start of its own function, since a call comes before it, so
+   lookup_function gives such an address to the function before.
+*/
+
+int compare_functions(const void* a, const void* b) {
+    uint64_t x = ((const function_entry_t*)a)->start;
+    uint64_t y = ((const function_entry_t*)b)->start;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+void sort_functions(function_entry_t* functions, uint64_t numFunctions) {
+    qsort(functions, numFunctions, sizeof(function_entry_t), compare_functions);
+}
+
+// Sizes the sorted functions of one stack map, each already spanning its last return
+// address.
+void size_functions(statepoint_table_t* table, function_entry_t* functions,
+                    uint64_t numFunctions) {
+    function_namer_t nameFunction = table->options.nameFunction;
+    for(uint64_t i = 0; i < numFunctions; i++) {
+        function_entry_t* fn = functions + i;
+        
+        // a function ending in a call has its last return address just past its
+        // symbol, so the symbol may only make it larger.
+        uint64_t size = 0;
+        if(nameFunction != NULL) {
+            nameFunction(fn->start + table->keyBase, &size, table->options.namerContext);
+        }
+        if(size == 0 && i + 1 < numFunctions) {
+            size = functions[i + 1].start - fn->start;
+        }
+        if(size > fn->size) {
+            fn->size = size;
+        }
+    }
+}
+
+// Sorts the functions of every stack map together, after the frames are inserted.
+void build_function_index(statepoint_table_t* table) {
+    sort_functions(table->functions, table->numFunctions);
+    for(uint64_t i = 0; i + 1 < table->numFunctions; i++) {
+        function_entry_t* next = table->functions + i + 1;
+        uint64_t gap = next->start - table->functions[i].start;
+        if(table->functions[i].size <= gap) {
+            continue;
+        }
+        
+        // see above
+        bool endsInCall = lookup_return_address(table, next->start + table->keyBase) != NULL;
+        table->functions[i].size = endsInCall ? gap + 1 : gap;
+    }
+}
+
+function_entry_t* lookup_function(statepoint_table_t* table, uint64_t address) {
+    address -= table->keyBase;
+
+    // the last function starting at or before the address
+    uint64_t low = 0;
+    uint64_t high = table->numFunctions;
+    while(low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if(table->functions[mid].start <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if(low == 0) {
+        return NULL;
+    }
+    function_entry_t* fn = table->functions + low - 1;
+    
+    // the last return address of the function before, see above.
+    if(address == fn->start && low > 1) {
+        function_entry_t* before = fn - 1;
+        if(address - before->start < before->size) {
+            return before;
+        }
+    }
+    return address - fn->start < fn->size ? fn : NULL;
+}
+
+const char* function_name(statepoint_table_t* table, function_entry_t* fn) {
+    if(table->options.nameFunction == NULL) {
+        return NULL;
+    }
+    uint64_t size = 0;
+    return table->options.nameFunction(fn->start + table->keyBase, &size,
+                                       table->options.namerContext);
+}
@@ -1,7 +1,14 @@
-#include "include/stackmap.h"
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "include/api.h"
+#include "include/stackmap.h"
 #include "include/hash_table.h"
 
+#include <pthread.h>
+#include <unistd.h>
+
 bool isBasePointer(value_location_t* first, value_location_t* second) {
     return first->kind == second->kind 
            && first->offset == second->offset;
@@ -11,14 +18,71 @@ bool isIndirect(value_location_t* p) {
     return p->kind == Indirect;
 }
 
+bool isConstant(value_location_t* p) {
+    return p->kind == Constant || p->kind == ConstIndex;
+}
+
+// What generate_frame_info needs besides the callsite, and what it collects
+// along the way. There is one per stack map being parsed.
+typedef struct {
+    table_options_t* options;
+    uint64_t* constants;        // the stack map's constant pool
+    uint32_t numConstants;
+    uint16_t frameFlags;        // frame_flags_t of the optional data to store in frames
+    
+    // the values of roots given by Constant and ConstIndex locations, with duplicates.
+    uint64_t* staticRoots;
+    uint64_t numStaticRoots;
+    uint64_t staticRootsCapacity;
+    
+    // records that aren't statepoints, if options->indexPatchpoints.
+    patchpoint_info_t** patchpoints;
+    uint64_t numPatchpoints;
+    uint64_t patchpointsCapacity;
+    
+    // the stack map's functions, sorted by address, see functions.c
+    function_entry_t* functions;
+    uint64_t numFunctions;
+    
+    // a statepoint's roots couldn't be described, see discard_frame.
+    bool failed;
+} parse_state_t;
+
+void add_static_root(parse_state_t* state, value_location_t* p) {
+    if(p->kind == ConstIndex && (p->offset < 0 || (uint32_t)p->offset >= state->numConstants)) {
+        fprintf(stderr, "(statepoint-utils) warning: \
+                         \n\tskipping a root whose constant index is out of range!\n");
+        return;
+    }
+    
+    uint64_t value = p->kind == ConstIndex ? state->constants[p->offset] 
+                                           : (uint64_t)(int64_t)p->offset;
+    if(value == 0) {
+        return; // null isn't a root
+    }
+    
+    if(state->numStaticRoots == state->staticRootsCapacity) {
+        state->staticRootsCapacity = 2 * state->staticRootsCapacity + 8;
+        state->staticRoots = realloc(state->staticRoots, 
+                                     state->staticRootsCapacity * sizeof(uint64_t));
+        assert(state->staticRoots && "bad alloc");
+    }
+    state->staticRoots[state->numStaticRoots++] = value;
+}
+
+// whether convert_offset can make the location's offset relative to the frame.
+bool frame_relative(value_location_t* p) {
+    return p->regNum == 7 || p->regNum == 6;
+}
+
 // The assumption is that the value_location given to this function
-// is known to be of the offset type, and now we need to parse the
+// is known to be of the offset type (an indirect or direct), and now we need to parse the
 // offset. Offsets are given relative to a register value,
-// and since it might be either the frame pointer or stack pointer.
+// and since it might be either the frame pointer or stack pointer, see frame_relative.
 //
 // This function will always return the offset relative to the stack ptr.
 int32_t convert_offset(value_location_t* p, uint64_t frameSize) {
-    assert(p->kind == Indirect && "not an indirect!");
+    assert((p->kind == Indirect || p->kind == Direct) && "not an offset!");
     
     // see the x86-64 SysV ABI documentation for the table of
     // registers and their corresponding Dwarf reg numbers
@@ -33,21 +97,14 @@ int32_t convert_offset(value_location_t* p, uint64_t frameSize) {
             return ((int32_t)frameSize) + p->offset;
         
         default:
-            fprintf(stderr, "(statepoint-utils) error: \
-                            \n\toffset is not relative to some part of the frame!\n");
-            exit(1);
+            assert(false && "offset is not relative to some part of the frame!");
+            return p->offset;
     }
 }
 
-frame_info_t* generate_frame_info(callsite_header_t* callsite, function_info_t* fn) {
-    uint64_t retAddr = fn->address + callsite->codeOffset;
-    uint64_t frameSize = fn->stackSize;
-    
-    // now we parse the location array according to the specific type 
-    // of locations that statepoints emit: 
-    // http://llvm.org/docs/Statepoints.html#stack-map-format
-    
-    uint16_t numLocations = callsite->numLocations;
+// Skips over the constants at the start of a statepoint's location array. Returns the
+// first of the "deopt" locations, and their count via numDeopt.
+value_location_t* deopt_locations(callsite_header_t* callsite, int32_t* numDeopt) {
     value_location_t* locations = (value_location_t*)(callsite + 1);
     
     // the first 2 locations are constants we dont care about, but if asserts are
@@ -57,19 +114,163 @@ frame_info_t* generate_frame_info(callsite_header_t* callsite, function_info_t*
         assert(locations->kind == Constant 
             && "first 2 locations must be constants in statepoint stackmaps");
         locations++;
-        numLocations--;
     }
     
     // the 3rd constant describes the number of "deopt" parameters
-    // that we should skip over.
+    // that follow it.
     assert(locations->kind == Constant && "3rd location should be a constant");
-    int32_t numDeopt = locations->offset;
+    *numDeopt = locations->offset;
     locations++;
-    numLocations--;
     
-    assert(numDeopt >= 0 && "unexpected negative here");
+    assert(*numDeopt >= 0 && "unexpected negative here");
+    return locations;
+}
+
+void add_patchpoint(parse_state_t* state, patchpoint_info_t* patchpoint) {
+    if(state->numPatchpoints == state->patchpointsCapacity) {
+        state->patchpointsCapacity = 2 * state->patchpointsCapacity + 8;
+        state->patchpoints = realloc(state->patchpoints, 
+                                     state->patchpointsCapacity * sizeof(patchpoint_info_t*));
+        assert(state->patchpoints && "bad alloc");
+    }
+    state->patchpoints[state->numPatchpoints++] = patchpoint;
+}
+
+// Decides whether a record was emitted for a statepoint in O(1) time, by checking
+// that the record has the layout of a statepoint: three leading constants, the third
+// of which counts the deopt locations that follow, and no liveouts. The ID convention
+// given in the options may rule out more records, but a record tagged as a statepoint
+// without the layout of one would be read out of bounds, so it isn't one.
+bool is_statepoint(callsite_header_t* callsite, table_options_t* options) {
+    if(options->statepointIdMask != 0
+        && (callsite->id & options->statepointIdMask) != options->statepointIdValue) {
+        return false;
+    }
+    
+    uint16_t numLocations = callsite->numLocations;
+    value_location_t* locations = (value_location_t*)(callsite + 1);
+    
+    if(numLocations < 3) {
+        return false;
+    }
+    
+    for(uint16_t i = 0; i < 3; i++) {
+        if(locations[i].kind != Constant) {
+            return false;
+        }
+    }
+    
+    int32_t numDeopt = locations[2].offset;
+    if(numDeopt < 0 || numDeopt > numLocations - 3) {
+        return false;
+    }
+    
+    uint64_t ptr_val = (uint64_t)(locations + numLocations);
+    ptr_val = (ptr_val + 7) & ~0x7;
+    liveout_header_t* liveout_header = (liveout_header_t*)ptr_val;
+    
+    return liveout_header->numLiveouts == 0;
+}
+
+// An open-addressing hash map used while building one frame, so that matching
+// derived pointers with their bases and dropping repeated roots takes linear time.
+// Base pointers are keyed by their offset, derived pointers by their base slot
+// and offset, see base_key and derived_key.
+typedef struct {
+    uint64_t* keys;
+    int32_t* values;    // -1 marks an empty entry
+    uint64_t mask;      // capacity - 1, the capacity being a power of two
+} slot_map_t;
+
+#define SMALL_SLOT_MAP 64
+
+uint64_t base_key(int32_t offset) {
+    return (UINT64_C(1) << 63) | (uint32_t)offset;
+}
+
+uint64_t derived_key(int32_t baseIdx, int32_t offset) {
+    return (((uint64_t)(uint32_t)baseIdx) << 32) | (uint32_t)offset;
+}
+
+// the small buffers are used instead of the heap when there are few enough roots.
+void init_slot_map(slot_map_t* map, uint32_t maxKeys, 
+                   uint64_t* smallKeys, int32_t* smallValues) {
+    uint64_t capacity = SMALL_SLOT_MAP;
+    while(capacity < 2 * (uint64_t)maxKeys) {
+        capacity *= 2;
+    }
+    
+    if(capacity == SMALL_SLOT_MAP) {
+        map->keys = smallKeys;
+        map->values = smallValues;
+    } else {
+        map->keys = malloc(capacity * sizeof(uint64_t));
+        map->values = malloc(capacity * sizeof(int32_t));
+        assert(map->keys && map->values && "bad alloc");
+    }
+    
+    map->mask = capacity - 1;
+    for(uint64_t i = 0; i < capacity; i++) {
+        map->values[i] = -1;
+    }
+}
+
+void free_slot_map(slot_map_t* map, uint64_t* smallKeys) {
+    if(map->keys != smallKeys) {
+        free(map->keys);
+        free(map->values);
+    }
+}
+
+// Returns the value of the key, after inserting the given value if the key was absent.
+int32_t find_or_insert_slot(slot_map_t* map, uint64_t key, int32_t value) {
+    uint64_t i = hashFn(key) & map->mask;
+    while(map->values[i] >= 0) {
+        if(map->keys[i] == key) {
+            return map->values[i];
+        }
+        i = (i + 1) & map->mask;
+    }
+    map->keys[i] = key;
+    map->values[i] = value;
+    return value;
+}
+
+// Gives up on a statepoint whose roots can't be described. A walk would stop at its
+// frames, missing the roots of every frame above them, so the whole table fails,
+// see generate_table_with_options.
+frame_info_t* discard_frame(frame_info_t* frame, slot_map_t* seen, uint64_t* smallKeys,
+                            parse_state_t* state, const char* reason) {
+    fprintf(stderr, "(statepoint-utils) error: \
+                     \n\t%s at return address 0x%" PRIX64 "!\n", reason, frame->retAddr);
+    free_slot_map(seen, smallKeys);
+    free(frame);
+    state->failed = true;
+    return NULL;
+}
+
+// Returns the number of locations making up the GC root that starts at loc,
+// see the comment in generate_frame_info.
+uint16_t root_width(value_location_t* loc) {
+    return loc->kind == Direct ? 1 : 2;
+}
+
+frame_info_t* generate_frame_info(callsite_header_t* callsite, function_info_t* fn,
+                                  parse_state_t* state) {
+    uint16_t flags = state->frameFlags;
+    uint64_t retAddr = fn->address + callsite->codeOffset;
+    uint64_t frameSize = fn->stackSize;
+    
+    // now we parse the location array according to the specific type 
+    // of locations that statepoints emit: 
+    // http://llvm.org/docs/Statepoints.html#stack-map-format
+    
+    int32_t numDeopt;
+    value_location_t* locations = deopt_locations(callsite, &numDeopt);
+    
+    // skip over the deopt parameters, see deopt.c for those.
     locations += numDeopt; 
-    numLocations -= numDeopt;
+    uint16_t numLocations = callsite->numLocations - 3 - numDeopt;
     
     /* 
        The remaining locations describe pointer that the GC should track, and use a special
@@ -90,45 +291,84 @@ frame_info_t* generate_frame_info(callsite_header_t* callsite, function_info_t*
        corresponding base pointers. If the Location is of size N x sizeof(pointer), then
        there will be N records of one pointer each contained within the Location. Both
        Locations in a pair can be assumed to be of the same size."
+       
+       The encoding has changed since LLVM 5, while the stack map version has not:
+       
+       - LLVM 5 emits one pair per gc.relocate, so pairs may be repeated, and every base
+         pointer has a (base, base) pair of its own. Stack slots that hold pointers
+         (gc allocas) are emitted as a pair of identical Direct locations.
+         
+       - Newer releases (we've checked LLVM 14) deduplicate the gc-live values and only
+         emit the pairs that are relocated, so a base pointer may only show up as the
+         first element of a derived pointer's pair. gc allocas are emitted after the
+         pairs, as a single Direct location each.
+       
+       We decode both by treating every Direct location as a root on its own, and every
+       other location as the start of a pair. Base pointers are collected from the first
+       element of each pair and repeated roots are dropped. A gc alloca is assumed to
+       hold a single pointer, since the record doesn't describe its contents.
     */
     
+    value_location_t* end = locations + numLocations;
     
-    assert((numLocations % 2) == 0 && "all of the pointer locations come in pairs!");
-    uint16_t numSlots = numLocations / 2; 
-    uint16_t numActualFrameSlots = numSlots;
+    // every location makes at most one slot.
+    uint32_t maxSlots = numLocations;
     
-    frame_info_t* frame = malloc(size_of_frame(numSlots));
+    uint64_t smallKeys[SMALL_SLOT_MAP];
+    int32_t smallValues[SMALL_SLOT_MAP];
+    slot_map_t seen;
+    init_slot_map(&seen, maxSlots, smallKeys, smallValues);
+    
+    frame_info_t* frame = malloc(size_of_frame(maxSlots, flags));
+    assert(frame && "bad alloc");
     frame->retAddr = retAddr;
     frame->frameSize = frameSize;
     
     // now to initialize the slots, we need to make two passes in order to put
     // base pointers first, then derived pointers.
     value_location_t *start = locations;
-    uint16_t numBasePtrs = 0;
+    int32_t numBasePtrs = 0;
     pointer_slot_t* currentSlot = frame->slots;
-    for(uint16_t i = 0; i < numSlots; i++, locations += 2) {
+    for(; locations < end; locations += root_width(locations)) {
         value_location_t* base = (value_location_t*)(locations);
         value_location_t* derived = (value_location_t*)(locations + 1);
         
-        // all locations must be indirects in order for it to be in the frame.
-        if (! (isIndirect(base) && isIndirect(derived)) ) {
+        if (base->kind != Direct) {
+            if (derived >= end) {
+                return discard_frame(frame, &seen, smallKeys, state, "unpaired root location");
+            }
+        
+            // all locations must be indirects in order for it to be in the frame.
+            if (! (isIndirect(base) && isIndirect(derived)) ) {
+                // a constant object is a root of every frame, so the GC should only
+                // scan it once, see table->staticRoots.
+                if (isConstant(base)) {
+                    add_static_root(state, base);
+                    continue;
+                }
 #ifndef NDEBUG
-            fprintf(stderr, "(statepoint-utils) warning: \n\t skipping a root location! \
-                            base kind: %i, derived kind: %i\n", base->kind, derived->kind);
+                fprintf(stderr, "(statepoint-utils) warning: \n\t skipping a root location! \
+                                base kind: %i, derived kind: %i\n", base->kind, derived->kind);
 #endif
-            numActualFrameSlots--;
-            continue;
+                continue;
+            }
         }
         
-        if( ! isBasePointer(base, derived)) {
-            continue;
+        // the derived pointer is converted in the second pass.
+        if (!frame_relative(base) || (base->kind != Direct && !frame_relative(derived))) {
+            return discard_frame(frame, &seen, smallKeys, state,
+                                 "a root is not relative to some part of the frame");
+        }
+        
+        // whether or not its pair is a derived pointer, the base is a base pointer.
+        int32_t offset = convert_offset(base, frameSize);
+        if (find_or_insert_slot(&seen, base_key(offset), numBasePtrs) != numBasePtrs) {
+            continue; // repeated
         }
         
-        // it's a base pointer, aka base is equivalent to derived.
-        // save the info.
         pointer_slot_t newSlot;
         newSlot.kind = -1;
-        newSlot.offset = convert_offset(base, frameSize);
+        newSlot.offset = offset;
         *currentSlot = newSlot;
         
         // get ready for next iteration
@@ -136,126 +376,556 @@ frame_info_t* generate_frame_info(callsite_header_t* callsite, function_info_t*
         currentSlot++;
     }
     
-    // once we've filtered out locations that are not within the frame, we can set this.
-    frame->numSlots = numActualFrameSlots;
-    
-    // now we do the derived pointers. we already know all locations are indirects now.
+    // now we do the derived pointers.
     locations = start;
-    pointer_slot_t* processedBase = frame->slots;
-    for(uint16_t i = 0; i < numSlots; i++, locations += 2) {
+    int32_t numSlots = numBasePtrs;
+    for(; locations < end; locations += root_width(locations)) {
         value_location_t* base = (value_location_t*)(locations);
         value_location_t* derived = (value_location_t*)(locations + 1);
         
-        if (! isIndirect(base) ) // skipped in the first pass.
+        if (base->kind == Direct) // a gc alloca, handled in the first pass.
+            continue;
+        
+        if (! (isIndirect(base) && isIndirect(derived)) ) // skipped in the first pass.
             continue;
         
         if (isBasePointer(base, derived)) {
-            // already processed, or derived is not an indirect.
+            // already processed.
             continue;
         }
         
-        // find the index in our frame corresponding to the base pointer.
-        uint16_t baseIdx;
-        bool found = false;
-        for(uint16_t k = 0; k < numBasePtrs; k++) {
-            if(processedBase[k].offset == base->offset) {
-                found = true;
-                baseIdx = k;
-                break;
-            }
-        }
+        // find the index in our frame corresponding to the base pointer,
+        // which the first pass made sure exists.
+        int32_t baseIdx = find_or_insert_slot(&seen, base_key(convert_offset(base, frameSize)), -1);
+        assert(baseIdx >= 0 && "couldn't find base for derived ptr");
+        int32_t offset = convert_offset(derived, frameSize);
         
-        // something's gone awry, let's bail!
-        if (!found) {
-            fprintf(stderr, "(statepoint-utils) error: \
-                             \n\tcouldn't find base for derived ptr!\n");
-            exit(1);
+        // drop repeated pairs.
+        if (find_or_insert_slot(&seen, derived_key(baseIdx, offset), numSlots) != numSlots) {
+            continue;
         }
+        numSlots++;
         
         // save the derived pointer's info
         pointer_slot_t newSlot;
         newSlot.kind = baseIdx;
-        newSlot.offset = convert_offset(derived, frameSize);
+        newSlot.offset = offset;
         *currentSlot = newSlot;
         
         // new iteration
         currentSlot++;
     }
     
+    // once we've filtered out locations that are not within the frame, we can set this.
+    frame->numSlots = numSlots;
+    free_slot_map(&seen, smallKeys);
+    
     // there is no liveout information emitted for statepoints, and we place faith in 
     // the input on that being the case
+    
+    // the optional data goes after the final slot, so we can only fill it in now.
+    frame->flags = flags;
+    frame->shape = 0;
+    if(flags & FRAME_HAS_ID) {
+        *frame_statepoint_id(frame) = callsite->id;
+    }
+    if(flags >> FRAME_USER_DATA_SHIFT) {
+        memset(frame_user_data(frame), 0, (flags >> FRAME_USER_DATA_SHIFT) * sizeof(uint64_t));
+    }
 
     return frame;
 }
 
-callsite_header_t* next_callsite(callsite_header_t* callsite) {
+// Returns the record after the given one, or NULL if the record runs past end. end is
+// NULL for a stack map already checked by split_section.
+callsite_header_t* next_callsite(callsite_header_t* callsite, uint8_t* end) {
+    uintptr_t cur = (uintptr_t)callsite;
+    uintptr_t limit = end != NULL ? (uintptr_t)end : UINTPTR_MAX;
+    
+    if(cur > limit || limit - cur < sizeof(callsite_header_t)) {
+        return NULL;
+    }
     uint16_t numLocations = callsite->numLocations;
+    cur += sizeof(callsite_header_t);
     
     // skip over locations
-    value_location_t* locations = (value_location_t*)(callsite + 1);
-    locations += numLocations;
+    if((limit - cur) / sizeof(value_location_t) < numLocations) {
+        return NULL;
+    }
+    cur += numLocations * sizeof(value_location_t);
     
     // realign pointer at the end of the locations to 8 byte alignment.
-    uint64_t ptr_val = (uint64_t)locations;
-    ptr_val = (ptr_val + 7) & ~0x7;
+    cur = (cur + 7) & ~(uintptr_t)0x7;
     
-    liveout_header_t* liveout_header = (liveout_header_t*)ptr_val;
-    uint16_t numLiveouts = liveout_header->numLiveouts;
+    if(cur > limit || limit - cur < sizeof(liveout_header_t)) {
+        return NULL;
+    }
+    uint16_t numLiveouts = ((liveout_header_t*)cur)->numLiveouts;
+    cur += sizeof(liveout_header_t);
     
     // skip over liveouts
-    liveout_location_t* liveouts = (liveout_location_t*)(liveout_header + 1);
-    liveouts += numLiveouts;
+    if((limit - cur) / sizeof(liveout_location_t) < numLiveouts) {
+        return NULL;
+    }
+    cur += numLiveouts * sizeof(liveout_location_t);
     
     // realign pointer again to 8 byte alignment for the next record.
-    ptr_val = (uint64_t)liveouts;
-    ptr_val = (ptr_val + 7) & ~0x7;
+    cur = (cur + 7) & ~(uintptr_t)0x7;
+    if(cur > limit) {
+        return NULL;
+    }
     
-    return (callsite_header_t*)ptr_val;
+    return (callsite_header_t*)cur;
 }
 
-statepoint_table_t* generate_table(void* map, float load_factor) {
+bool valid_header(stackmap_header_t* header) {
+    if (header->version != 3) {
+        fprintf(stderr, "(statepoint-utils) error: \
+                         \n\tonly LLVM stackmap version 3 is supported.\n");
+        return false;
+    }
+    
+    if(header->reserved1 != 0 || header->reserved2 != 0) {
+        fprintf(stderr, "(statepoint-utils) error: \
+                         \n\tthe reserved bytes of a stack map header are not 0.\n");
+        return false;
+    }
+    return true;
+}
 
-    uint8_t* version = (uint8_t*)map;
-    if (*version != 3) {
-        printf("error: only LLVM stackmap version 3 is supported.\n");
-        assert(false && "see above");
-        return NULL;
+callsite_header_t* first_callsite(stackmap_header_t* header) {
+    function_info_t* functions = (function_info_t*)(header + 1);
+    
+    // we skip over constants, which are uint64_t's
+    return (callsite_header_t*)(
+            ((uint64_t*)(functions + header->numFunctions)) + header->numConstants
+        );
+}
+
+uint64_t* stackmap_constants(stackmap_header_t* header) {
+    function_info_t* functions = (function_info_t*)(header + 1);
+    return (uint64_t*)(functions + header->numFunctions);
+}
+
+void callsite_iter_init(callsite_iter_t* iter, stackmap_header_t* header) {
+    iter->fn = (function_info_t*)(header + 1);
+    iter->callsite = first_callsite(header);
+    iter->visited = 0;
+    iter->remaining = header->numRecords;
+    
+    while(iter->remaining > 0 && iter->visited >= iter->fn->callsiteCount) {
+        iter->fn++;
     }
+}
 
-    stackmap_header_t* header = (stackmap_header_t*)map;
+void callsite_iter_next(callsite_iter_t* iter) {
+    iter->callsite = next_callsite(iter->callsite, NULL);
+    iter->visited++;
+    iter->remaining--;
     
-    assert(header->reserved1 == 0 && "expected to be 0");
-    assert(header->reserved2 == 0 && "expected to be 0");
+    // callsites are grouped by function, in the same order as the functions.
+    while(iter->remaining > 0 && iter->visited >= iter->fn->callsiteCount) {
+        iter->fn++;
+        iter->visited = 0;
+    }
+}
+
+// Parses every callsite of a single stack map, handing each frame to out[i]. 
+// out[i] is NULL if the record isn't a statepoint.
+void generate_blob_frames(stackmap_header_t* header, frame_info_t** out, 
+                          parse_state_t* state) {
+    state->constants = stackmap_constants(header);
+    state->numConstants = header->numConstants;
+    
+    function_info_t* firstFn = (function_info_t*)(header + 1);
+    state->numFunctions = header->numFunctions;
+    state->functions = malloc((header->numFunctions + 1) * sizeof(function_entry_t));
+    assert(state->functions && "bad alloc");
+    for(uint64_t f = 0; f < header->numFunctions; f++) {
+        state->functions[f].start = firstFn[f].address;
+        state->functions[f].size = 0;
+        state->functions[f].stackSize = firstFn[f].stackSize;
+        state->functions[f].numCallsites = firstFn[f].callsiteCount;
+    }
     
-    uint64_t numCallsites = header->numRecords;
+    callsite_iter_t iter;
+    uint64_t i = 0;
+    for(callsite_iter_init(&iter, header); iter.remaining > 0; callsite_iter_next(&iter)) {
+        // every return address is within its function.
+        function_entry_t* fn = state->functions + (iter.fn - firstFn);
+        if(iter.callsite->codeOffset >= fn->size) {
+            fn->size = (uint64_t)iter.callsite->codeOffset + 1;
+        }
+        
+        if(is_statepoint(iter.callsite, state->options)) {
+            out[i++] = generate_frame_info(iter.callsite, iter.fn, state);
+            continue;
+        }
+        
+        out[i++] = NULL;
+        if(state->options->indexPatchpoints) {
+            add_patchpoint(state, generate_patchpoint_info(iter.callsite, iter.fn, 
+                                                           state->constants,
+                                                           state->numConstants));
+        }
+    }
+}
+
+// Returns the address just past the last record of the given stack map, or NULL if
+// it runs past end or its functions don't account for its records. end is NULL for a
+// stack map already checked by split_section.
+uint8_t* end_of_blob(stackmap_header_t* header, uint8_t* end) {
+    uintptr_t cur = (uintptr_t)(header + 1);
+    uintptr_t limit = end != NULL ? (uintptr_t)end : UINTPTR_MAX;
     
-    statepoint_table_t* table = new_table(load_factor, numCallsites);
+    // the functions and constants come before the records.
+    if(cur > limit 
+        || (limit - cur) / sizeof(function_info_t) < header->numFunctions) {
+        return NULL;
+    }
+    cur += header->numFunctions * sizeof(function_info_t);
+    if((limit - cur) / sizeof(uint64_t) < header->numConstants) {
+        return NULL;
+    }
     
+    // callsite_iter_t moves on to the next function after the callsites of each.
     function_info_t* functions = (function_info_t*)(header + 1);
+    uint64_t numCallsites = 0;
+    for(uint32_t i = 0; i < header->numFunctions && numCallsites < header->numRecords; i++) {
+        uint64_t count = functions[i].callsiteCount;
+        numCallsites += count < header->numRecords ? count : header->numRecords;
+    }
+    if(numCallsites < header->numRecords) {
+        return NULL;
+    }
     
-    // we skip over constants, which are uint64_t's
-    callsite_header_t* callsite = 
-        (callsite_header_t*)(
-            ((uint64_t*)(functions + header->numFunctions)) + header->numConstants
-        );
+    callsite_header_t* callsite = first_callsite(header);
+    for(uint64_t i = 0; i < header->numRecords && callsite != NULL; i++) {
+        callsite = next_callsite(callsite, end);
+    }
+    return (uint8_t*)callsite;
+}
+
+statepoint_table_t* generate_table(void* map, float load_factor) {
+
+    stackmap_header_t* header = (stackmap_header_t*)map;
+    if (!valid_header(header)) {
+        assert(false && "see above");
+        return NULL;
+    }
     
+    uint8_t* end = end_of_blob(header, NULL);
+    if(end == NULL) {
+        assert(false && "malformed stack map");
+        return NULL;
+    }
+    
+    size_t length = end - (uint8_t*)map;
+    return generate_table_from_section(map, length, load_factor);
+}
+
+
+/**** Sections holding many stack maps ****/
+
+int compare_roots(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+void dedup_static_roots(statepoint_table_t* table) {
+    uint64_t* roots = table->staticRoots;
+    qsort(roots, table->numStaticRoots, sizeof(uint64_t), compare_roots);
     
-    function_info_t* currentFn = functions;
-    uint64_t visited = 0;
-    for(uint64_t _unused = 0; _unused < numCallsites; _unused++) {
-        if(visited >= currentFn->callsiteCount) {
-            currentFn++;
-            visited = 0;
+    uint64_t numUnique = 0;
+    for(uint64_t i = 0; i < table->numStaticRoots; i++) {
+        if(numUnique == 0 || roots[numUnique - 1] != roots[i]) {
+            roots[numUnique++] = roots[i];
         }
+    }
+    table->numStaticRoots = numUnique;
+}
+
+// The work shared by the threads parsing a section. Each blob's frames are written
+// to its own range of the frames array, so the workers never write to shared state
+// other than the blob counter.
+typedef struct {
+    stackmap_header_t** blobs;
+    uint64_t* firstFrame;   // index into frames of each blob's first callsite
+    uint64_t numBlobs;
+    uint64_t nextBlob;      // next blob to claim, only accessed atomically
+    frame_info_t** frames;
+    parse_state_t* states;  // one per blob
+} section_work_t;
 
-        frame_info_t* info = generate_frame_info(callsite, currentFn);
+void* section_worker(void* arg) {
+    section_work_t* work = (section_work_t*)arg;
+    while(true) {
+        uint64_t i = __atomic_fetch_add(&work->nextBlob, 1, __ATOMIC_RELAXED);
+        if(i >= work->numBlobs) {
+            return NULL;
+        }
+        generate_blob_frames(work->blobs[i], work->frames + work->firstFrame[i], 
+                             work->states + i);
+    }
+}
+
+// Frees what the workers parsed, for a table that won't be made.
+void discard_work(section_work_t* work, uint64_t numCallsites) {
+    for(uint64_t i = 0; i < numCallsites; i++) {
+        free(work->frames[i]);
+    }
+    for(uint64_t i = 0; i < work->numBlobs; i++) {
+        parse_state_t* state = work->states + i;
+        free(state->staticRoots);
+        for(uint64_t k = 0; k < state->numPatchpoints; k++) {
+            free(state->patchpoints[k]);
+        }
+        free(state->patchpoints);
+        free(state->functions);
+    }
+    
+    free(work->states);
+    free(work->frames);
+    free(work->firstFrame);
+    free(work->blobs);
+}
+
+// Splits the section into its stack maps. Linkers pad input sections to their
+// alignment with zeros, which we skip over. Returns the number of blobs found,
+// or -1 if the section is malformed. If blobs is NULL, the blobs are only counted.
+int64_t split_section(uint8_t* cur, uint8_t* end, 
+                      stackmap_header_t** blobs, uint64_t* numCallsites) {
+    int64_t numBlobs = 0;
+    *numCallsites = 0;
+    
+    while(cur < end) {
+        if(*cur == 0) {
+            cur++;
+            continue;
+        }
         
-        insert_key(table, info->retAddr, info);
+        stackmap_header_t* header = (stackmap_header_t*)cur;
+        if((size_t)(end - cur) < sizeof(stackmap_header_t) || !valid_header(header)) {
+            return -1;
+        }
         
-        // setup next iteration
-        callsite = next_callsite(callsite);
-        visited++;
+        cur = end_of_blob(header, end);
+        if(cur == NULL) {
+            fprintf(stderr, "(statepoint-utils) error: \
+                             \n\tstack map runs past the end of the section!\n");
+            return -1;
+        }
+        
+        if(blobs != NULL) {
+            blobs[numBlobs] = header;
+        }
+        numBlobs++;
+        *numCallsites += header->numRecords;
+    }
+    
+    return numBlobs;
+}
+
+void default_table_options(table_options_t* options) {
+    options->loadFactor = 0.5;
+    options->recordIds = false;
+    options->statepointIdMask = 0;
+    options->statepointIdValue = 0;
+    options->indexPatchpoints = false;
+    options->userDataSize = 0;
+    options->sealed = false;
+    options->cacheDir = NULL;
+    options->nameFunction = NULL;
+    options->namerContext = NULL;
+}
+
+statepoint_table_t* generate_table_from_section(void* section, size_t length, 
+                                                float load_factor) {
+    table_options_t options;
+    default_table_options(&options);
+    options.loadFactor = load_factor;
+    return generate_table_with_options(section, length, &options);
+}
+
+statepoint_table_t* generate_table_with_options(void* section, size_t length,
+                                                table_options_t* options) {
+    uint8_t* start = (uint8_t*)section;
+    uint8_t* end = start + length;
+    
+    uint64_t numCallsites;
+    int64_t numBlobs = split_section(start, end, NULL, &numCallsites);
+    if(numBlobs < 0) {
+        assert(false && "malformed stack map section");
+        return NULL;
+    }
+    if(options->userDataSize > STATEPOINT_MAX_USER_DATA) {
+        assert(false && "too much user data per frame");
+        return NULL;
+    }
+    
+    if(options->cacheDir != NULL) {
+        statepoint_table_t* cached = load_cached_table(section, length, options);
+        if(cached != NULL) {
+            return cached;
+        }
+    }
+    
+    uint16_t frameFlags = options->recordIds ? FRAME_HAS_ID : 0;
+    frameFlags |= ((options->userDataSize + 7) / 8) << FRAME_USER_DATA_SHIFT;
+    
+    section_work_t work;
+    work.numBlobs = numBlobs;
+    work.nextBlob = 0;
+    work.blobs = malloc((numBlobs + 1) * sizeof(stackmap_header_t*));
+    work.firstFrame = malloc((numBlobs + 1) * sizeof(uint64_t));
+    work.frames = malloc((numCallsites + 1) * sizeof(frame_info_t*));
+    work.states = calloc(numBlobs + 1, sizeof(parse_state_t));
+    assert(work.blobs && work.firstFrame && work.frames && work.states && "bad alloc");
+    
+    split_section(start, end, work.blobs, &numCallsites);
+    
+    uint64_t nextFrame = 0;
+    for(int64_t i = 0; i < numBlobs; i++) {
+        work.firstFrame[i] = nextFrame;
+        work.states[i].options = options;
+        work.states[i].frameFlags = frameFlags;
+        nextFrame += work.blobs[i]->numRecords;
+    }
+    
+    // one worker per blob, up to the number of CPUs. the calling thread is a worker too.
+    long numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t numThreads = numCPUs > 0 ? (uint64_t)numCPUs : 1;
+    if(numThreads > work.numBlobs) {
+        numThreads = work.numBlobs;
     }
     
+    pthread_t* threads = malloc((numThreads + 1) * sizeof(pthread_t));
+    assert(threads && "bad alloc");
+    
+    uint64_t numStarted = 0;
+    for(uint64_t i = 1; i < numThreads; i++, numStarted++) {
+        if(pthread_create(threads + numStarted, NULL, section_worker, &work) != 0) {
+            break; // the remaining workers pick up the slack.
+        }
+    }
+    
+    section_worker(&work);
+    
+    for(uint64_t i = 0; i < numStarted; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    
+    // see discard_frame
+    for(int64_t i = 0; i < numBlobs; i++) {
+        if(work.states[i].failed) {
+            discard_work(&work, numCallsites);
+            return NULL;
+        }
+    }
+    
+    // inserting is serial, since buckets are shared between blobs.
+    statepoint_table_t* table = new_table(options->loadFactor, 
+                                          numCallsites > 0 ? numCallsites : 1);
+    table->section = section;
+    table->sectionLength = length;
+    table->options = *options;
+    if(options->cacheDir != NULL) {
+        table->keyBase = module_key_base(section);
+    }
+    for(uint64_t i = 0; i < numCallsites; i++) {
+        if(work.frames[i] != NULL) {
+            work.frames[i]->retAddr -= table->keyBase;
+            insert_key(table, work.frames[i]->retAddr, work.frames[i]);
+        }
+    }
+    
+    // frames don't move once they're all inserted.
+    if(options->recordIds) {
+        build_id_index(table);
+    }
+    
+    // the static roots of all stack maps are put together, without duplicates.
+    uint64_t numStaticRoots = 0;
+    for(int64_t i = 0; i < numBlobs; i++) {
+        numStaticRoots += work.states[i].numStaticRoots;
+    }
+    
+    table->staticRoots = malloc((numStaticRoots + 1) * sizeof(uint64_t));
+    assert(table->staticRoots && "bad alloc");
+    
+    for(int64_t i = 0; i < numBlobs; i++) {
+        // a stack map without constant roots never allocated any.
+        if(work.states[i].numStaticRoots > 0) {
+            memcpy(table->staticRoots + table->numStaticRoots, work.states[i].staticRoots,
+                   work.states[i].numStaticRoots * sizeof(uint64_t));
+            table->numStaticRoots += work.states[i].numStaticRoots;
+        }
+        free(work.states[i].staticRoots);
+    }
+    dedup_static_roots(table);
+    
+    uint64_t numPatchpoints = 0;
+    for(int64_t i = 0; i < numBlobs; i++) {
+        numPatchpoints += work.states[i].numPatchpoints;
+    }
+    
+    table->patchpoints = malloc((numPatchpoints + 1) * sizeof(patchpoint_info_t*));
+    assert(table->patchpoints && "bad alloc");
+    
+    for(int64_t i = 0; i < numBlobs; i++) {
+        // likewise for stack maps without patchpoints.
+        if(work.states[i].numPatchpoints > 0) {
+            memcpy(table->patchpoints + table->numPatchpoints, work.states[i].patchpoints,
+                   work.states[i].numPatchpoints * sizeof(patchpoint_info_t*));
+            table->numPatchpoints += work.states[i].numPatchpoints;
+        }
+        free(work.states[i].patchpoints);
+    }
+    for(uint64_t i = 0; i < table->numPatchpoints; i++) {
+        table->patchpoints[i]->address -= table->keyBase;
+    }
+    sort_patchpoints(table);
+    
+    uint64_t numFunctions = 0;
+    for(int64_t i = 0; i < numBlobs; i++) {
+        numFunctions += work.states[i].numFunctions;
+    }
+    
+    table->functions = malloc((numFunctions + 1) * sizeof(function_entry_t));
+    assert(table->functions && "bad alloc");
+    
+    for(int64_t i = 0; i < numBlobs; i++) {
+        function_entry_t* functions = work.states[i].functions;
+        for(uint64_t k = 0; k < work.states[i].numFunctions; k++) {
+            functions[k].start -= table->keyBase;
+        }
+        sort_functions(functions, work.states[i].numFunctions);
+        size_functions(table, functions, work.states[i].numFunctions);
+        
+        memcpy(table->functions + table->numFunctions, functions,
+               work.states[i].numFunctions * sizeof(function_entry_t));
+        table->numFunctions += work.states[i].numFunctions;
+        free(functions);
+    }
+    build_function_index(table);
+    
+    // only sealed tables are cached, since the file is a copy of the region.
+    bool seal = options->sealed || options->cacheDir != NULL;
+    if(seal && !seal_table(table)) {
+        fprintf(stderr, "(statepoint-utils) warning: \
+                         \n\tcouldn't seal the table, leaving it in the heap.\n");
+    }
+    
+    if(options->cacheDir != NULL && table->region != NULL) {
+        store_cached_table(table);
+    }
+    
+    free(work.states);
+    free(work.frames);
+    free(work.firstFrame);
+    free(work.blobs);
+    
     return table;
 }
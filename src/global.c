@@ -0,0 +1,64 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "include/api.h"
+#include "include/hash_table.h"
+
+#include <pthread.h>
+
+// The process-wide table. Both pointers are written once under globalLock and read
+// with acquire loads, so lookups never take the lock after the table is published.
+static statepoint_table_t* globalTable = NULL;
+static table_build_t* globalBuild = NULL;
+static pthread_mutex_t globalLock = PTHREAD_MUTEX_INITIALIZER;
+
+void start_global_table(void* section, size_t length, table_options_t* options) {
+    if(__atomic_load_n(&globalBuild, __ATOMIC_ACQUIRE) != NULL) {
+        return;
+    }
+    
+    pthread_mutex_lock(&globalLock);
+    if(globalBuild == NULL) {
+        __atomic_store_n(&globalBuild, start_table_build(section, length, options), 
+                         __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&globalLock);
+}
+
+statepoint_table_t* init_global_table(void* section, size_t length, table_options_t* options) {
+    start_global_table(section, length, options);
+    return global_table();
+}
+
+statepoint_table_t* global_table(void) {
+    statepoint_table_t* table = __atomic_load_n(&globalTable, __ATOMIC_ACQUIRE);
+    if(table != NULL) {
+        return table;
+    }
+    
+    table_build_t* build = __atomic_load_n(&globalBuild, __ATOMIC_ACQUIRE);
+    if(build == NULL) {
+        return NULL;
+    }
+    
+    // every waiter stores the same table, so publishing it more than once is harmless.
+    table = await_table(build);
+    __atomic_store_n(&globalTable, table, __ATOMIC_RELEASE);
+    return table;
+}
+
+void destroy_global_table(void) {
+    pthread_mutex_lock(&globalLock);
+    if(globalBuild != NULL) {
+        statepoint_table_t* table = await_table(globalBuild);
+        if(table != NULL) {
+            destroy_table(table);
+        }
+        destroy_table_build(globalBuild);
+        
+        __atomic_store_n(&globalTable, NULL, __ATOMIC_RELEASE);
+        __atomic_store_n(&globalBuild, NULL, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&globalLock);
+}
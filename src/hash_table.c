@@ -2,30 +2,41 @@
 #include "include/hash_table.h"
 
 
-/**
- * The hash function used to distribute keys uniformly across the table.
- * The implementation is one round of the xorshift64* algorithm.
- * Code Source: Wikipedia
- */
 uint64_t hashFn(uint64_t x) {
-    x ^= x >> 12; // a
-	x ^= x << 25; // b
-	x ^= x >> 27; // c
-	return x * UINT64_C(2685821657736338717);
+    return statepoint_hash(x);
 }
 
+// must agree with lookup_return_address_inline
 uint64_t computeBucketIndex(statepoint_table_t* table, uint64_t key) {
-    // Using modulo may introduce a little bias in the table. 
-    // If you care, use the unbiased version that's floating around the internet.
     return hashFn(key) % table->size;
 }
 
-size_t size_of_frame(uint16_t numSlots) {
-    return sizeof(frame_info_t) + numSlots * sizeof(pointer_slot_t);
+size_t offset_of_extras(uint32_t numSlots) {
+    return statepoint_offset_of_extras(numSlots);
+}
+
+size_t size_of_frame(uint32_t numSlots, uint16_t flags) {
+    size_t size = offset_of_extras(numSlots);
+    if(flags & FRAME_HAS_ID) {
+        size += sizeof(uint64_t);
+    }
+    size += (size_t)(flags >> FRAME_USER_DATA_SHIFT) * sizeof(uint64_t);
+    return size;
 }
 
 size_t frame_size(frame_info_t* frame) {
-    return size_of_frame(frame->numSlots);
+    return statepoint_frame_size(frame);
+}
+
+uint64_t* frame_statepoint_id(frame_info_t* frame) {
+    if(!(frame->flags & FRAME_HAS_ID)) {
+        return NULL;
+    }
+    return (uint64_t*)(((uint8_t*)frame) + offset_of_extras(frame->numSlots));
+}
+
+void* frame_user_data(frame_info_t* frame) {
+    return statepoint_user_data(frame);
 }
 
 // returns the next frame relative the current frame
@@ -49,18 +60,51 @@ statepoint_table_t* new_table(float loadFactor, uint64_t expectedElms) {
     
     table->size = numBuckets;
     table->buckets = buckets;
+    table->keyBase = 0;
+    table->section = NULL;
+    table->sectionLength = 0;
+    table->deopt = NULL;
+    table->numIds = 0;
+    table->ids = NULL;
+    table->numStaticRoots = 0;
+    table->staticRoots = NULL;
+    table->numPatchpoints = 0;
+    table->patchpoints = NULL;
+    table->numFunctions = 0;
+    table->functions = NULL;
+    table->region = NULL;
+    table->regionSize = 0;
+    default_table_options(&table->options);
     
     return table;
 }
 
 
 void destroy_table(statepoint_table_t* table) {
+    if(table->deopt != NULL) {
+        destroy_deopt_table(table->deopt);
+    }
+    
+    // everything else lives in the region of a sealed table.
+    if(table->region != NULL) {
+        unmap_region(table->region, table->regionSize);
+        free(table);
+        return;
+    }
+    
     for(uint64_t i = 0; i < table->size; i++) {
         frame_info_t* entry = table->buckets[i].entries;
         if(entry != NULL) {
             free(entry);
         }
     }
+    free(table->ids);
+    free(table->staticRoots);
+    for(uint64_t i = 0; i < table->numPatchpoints; i++) {
+        free(table->patchpoints[i]);
+    }
+    free(table->patchpoints);
+    free(table->functions);
     free(table->buckets);
     free(table);
 }
@@ -70,6 +114,8 @@ void destroy_table(statepoint_table_t* table) {
 // the key is considered the final use of the pointer (i.e., value will be freed by the
 // function).
 void insert_key(statepoint_table_t* table, uint64_t key, frame_info_t* value) {
+    assert(table->region == NULL && "sealed tables can't be modified");
+    
     uint64_t idx = computeBucketIndex(table, key);
     table_bucket_t *bucket = table->buckets + idx;
     
@@ -101,25 +147,82 @@ void insert_key(statepoint_table_t* table, uint64_t key, frame_info_t* value) {
 
 
 frame_info_t* lookup_return_address(statepoint_table_t *table, uint64_t retAddr) {
-    uint64_t idx = computeBucketIndex(table, retAddr);
-    table_bucket_t bucket = table->buckets[idx];
+    return lookup_return_address_inline(table, retAddr);
+}
+
+int compare_id_entries(const void* a, const void* b) {
+    const id_entry_t* x = (const id_entry_t*)a;
+    const id_entry_t* y = (const id_entry_t*)b;
+    if(x->id != y->id) {
+        return x->id < y->id ? -1 : 1;
+    }
+    // keep the order of frames sharing an ID deterministic
+    if(x->frame->retAddr != y->frame->retAddr) {
+        return x->frame->retAddr < y->frame->retAddr ? -1 : 1;
+    }
+    return 0;
+}
+
+// Writes the sorted ID index of the table's frames to ids, which may be NULL to
+// only count the entries. Returns the number of entries.
+uint64_t fill_id_index(statepoint_table_t* table, id_entry_t* ids) {
+    uint64_t numIds = 0;
+    for(uint64_t i = 0; i < table->size; i++) {
+        frame_info_t* entry = table->buckets[i].entries;
+        for(uint32_t k = 0; k < table->buckets[i].numEntries; k++, entry = next_frame(entry)) {
+            if(entry->flags & FRAME_HAS_ID) {
+                if(ids != NULL) {
+                    ids[numIds].id = *frame_statepoint_id(entry);
+                    ids[numIds].frame = entry;
+                }
+                numIds++;
+            }
+        }
+    }
     
-    uint16_t bucketLimit = bucket.numEntries;
-    frame_info_t* entries = bucket.entries;
+    if(ids != NULL) {
+        qsort(ids, numIds, sizeof(id_entry_t), compare_id_entries);
+    }
+    return numIds;
+}
+
+void build_id_index(statepoint_table_t* table) {
+    uint64_t numIds = fill_id_index(table, NULL);
     
-    for(uint16_t i = 0; i < bucketLimit; i++) {
-        if(entries->retAddr == retAddr) {
-            return entries;
+    id_entry_t* ids = malloc((numIds + 1) * sizeof(id_entry_t));
+    assert(ids && "bad alloc");
+    fill_id_index(table, ids);
+    
+    free(table->ids);
+    table->ids = ids;
+    table->numIds = numIds;
+}
+
+id_entry_t* lookup_statepoint_id(statepoint_table_t* table, uint64_t id, uint64_t* count) {
+    // find the first entry whose ID is not less than id
+    uint64_t lo = 0;
+    uint64_t hi = table->numIds;
+    while(lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if(table->ids[mid].id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        entries = next_frame(entries);
     }
     
-    return NULL;
+    uint64_t end = lo;
+    while(end < table->numIds && table->ids[end].id == id) {
+        end++;
+    }
+    
+    *count = end - lo;
+    return end > lo ? table->ids + lo : NULL;
 }
 
 void print_table(FILE *stream, statepoint_table_t* table, bool skip_empty) {
     for(uint64_t i = 0; i < table->size; i++) {
-        uint16_t numEntries = table->buckets[i].numEntries;
+        uint32_t numEntries = table->buckets[i].numEntries;
         size_t sizeOfEntries = table->buckets[i].sizeOfEntries;
         frame_info_t* entry = table->buckets[i].entries;
         
@@ -128,11 +231,11 @@ void print_table(FILE *stream, statepoint_table_t* table, bool skip_empty) {
         }
         
         fprintf(stream, "\n--- bucket #%" PRIu64 "---\n", i);
-        fprintf(stream, "num entries: %" PRIu16 ", ", numEntries);
+        fprintf(stream, "num entries: %" PRIu32 ", ", numEntries);
         fprintf(stream, "memory allocated (bytes): %" PRIuPTR "\n", sizeOfEntries);
         
-        for(uint16_t i = 0; i < numEntries; i++, entry = next_frame(entry)) {
-            fprintf(stream, "\t** frame #%" PRIu16 "**\n", i);
+        for(uint32_t i = 0; i < numEntries; i++, entry = next_frame(entry)) {
+            fprintf(stream, "\t** frame #%" PRIu32 "**\n", i);
             print_frame(stream, entry);
         }
     }
@@ -143,12 +246,17 @@ void print_frame(FILE *stream, frame_info_t* frame) {
     fprintf(stream, "\t\treturn address: 0x%" PRIX64 "\n", frame->retAddr);
     fprintf(stream, "\t\tframe size: %" PRIu64 "\n", frame->frameSize);
     
-    uint16_t numSlots = frame->numSlots;
+    uint64_t* id = frame_statepoint_id(frame);
+    if(id != NULL) {
+        fprintf(stream, "\t\tstatepoint id: 0x%" PRIX64 "\n", *id);
+    }
+    
+    uint32_t numSlots = frame->numSlots;
     pointer_slot_t* curSlot = frame->slots;
-    fprintf(stream, "\t\tnum live ptrs: %" PRIu16 "\n", numSlots);
+    fprintf(stream, "\t\tnum live ptrs: %" PRIu32 "\n", numSlots);
     
-    for(uint16_t i = 0; i < numSlots; i++, curSlot++) {
-        fprintf(stream, "\t\tptr slot #%" PRIu16 " { ", i);
+    for(uint32_t i = 0; i < numSlots; i++, curSlot++) {
+        fprintf(stream, "\t\tptr slot #%" PRIu32 " { ", i);
         
         int32_t kind = curSlot->kind;
         if(kind < 0) {
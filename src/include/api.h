@@ -2,6 +2,7 @@
 #define __LLVM_STATEPOINT_UTILS_API__
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -47,22 +48,249 @@ typedef struct {
     // all base pointers come before derived pointers in the slot array. you can use this
     // fact to quickly update the derived pointers by referring back to the base pointers
     // while scanning the slots.
-    uint16_t numSlots;
+    uint32_t numSlots;
+    
+    // frame_flags_t values describing optional data stored after the slots.
+    // must be 0 for frames built by hand for insert_key.
+    uint16_t flags;
+    
+    // the scanning routine of frames compiled by llvm-statepoint-compile, see the
+    // README. 0 for all other frames.
+    uint16_t shape;
     pointer_slot_t slots[];  
 } frame_info_t;
 
+typedef enum {
+    FRAME_HAS_ID = 0x1,   // the statepoint ID follows the slots, see frame_statepoint_id
+    
+    // the high byte of flags is the number of words of user data after the slots and
+    // the ID, see frame_user_data.
+    FRAME_USER_DATA_SHIFT = 8
+} frame_flags_t;
+
+// the most user data a frame can hold, in bytes. see table_options_t.
+#define STATEPOINT_MAX_USER_DATA (0xFF * 8)
+
 
 typedef struct {
-    uint16_t numEntries;
+    uint32_t numEntries;
     size_t sizeOfEntries; // total memory footprint of the entries
     frame_info_t* entries;
 } table_bucket_t;
 
+typedef enum {
+    VALUE_UNKNOWN = 0,       // the location is malformed, or of a kind we don't know
+    VALUE_IN_REGISTER = 1,   // the value is in the Dwarf register regNum
+    VALUE_FRAME_ADDRESS = 2, // the value is the address base + value (see Figure 1)
+    VALUE_IN_FRAME = 3,      // the value is stored at base + value (see Figure 1)
+    VALUE_CONSTANT = 4,      // the value is the value field itself
+    
+    // locations relative to a register other than the stack or frame pointer, e.g. the
+    // base pointer of a realigned frame, with the raw offset in value.
+    VALUE_REGISTER_ADDRESS = 5,  // the value is the address regNum + value
+    VALUE_IN_MEMORY = 6          // the value is stored at regNum + value
+} value_kind_t;
+
+typedef struct {
+    uint16_t kind;      // a value_kind_t
+    uint16_t size;      // in bytes
+    uint16_t regNum;    // the Dwarf register of VALUE_IN_REGISTER, VALUE_REGISTER_ADDRESS
+                        // and VALUE_IN_MEMORY
+    int64_t value;      // a frame offset or a constant, depending on the kind
+} value_info_t;
+
+// The deoptimization state of a callsite, i.e., the locations of the values
+// passed in the "deopt" operand bundle of the statepoint, in the same order.
+typedef struct {
+    uint64_t retAddr;
+    uint32_t numValues;
+    value_info_t values[];
+} deopt_info_t;
+
+// built lazily by lookup_deopt_state, see deopt.c
+typedef struct deopt_table deopt_table_t;
+
+typedef struct {
+    uint64_t id;
+    frame_info_t* frame;
+} id_entry_t;
+
+// A function with statepoints, see lookup_function.
+typedef struct {
+    uint64_t start;         // its address, minus keyBase
+    uint64_t size;          // in bytes, see lookup_function
+    uint64_t stackSize;     // the frameSize of its frames
+    uint64_t numCallsites;  // its records in the stack map, statepoints or not
+} function_entry_t;
+
+// Returns the name of the function at the given address, or NULL if it's unknown, and
+// sets size to the size of the function if it's known. See table_options_t.
+typedef const char* (*function_namer_t)(uint64_t address, uint64_t* size, void* context);
+
+typedef struct {
+    float loadFactor;   // see generate_table
+    
+    // store each callsite's statepoint ID in its frame, and index the frames by ID.
+    // see frame_statepoint_id and lookup_statepoint_id.
+    bool recordIds;
+    
+    // Stack maps may also contain records of patchpoint and stackmap intrinsics. A
+    // record is taken to be a statepoint if its locations have the shape of one. When
+    // statepointIdMask is not 0, it must also have 
+    // (id & statepointIdMask) == statepointIdValue.
+    uint64_t statepointIdMask;
+    uint64_t statepointIdValue;
+    
+    // keep the records that aren't statepoints in an index, see lookup_patchpoint.
+    // otherwise they are skipped.
+    bool indexPatchpoints;
+    
+    // the bytes of user data to reserve in every frame, up to STATEPOINT_MAX_USER_DATA,
+    // see frame_user_data.
+    uint32_t userDataSize;
+    
+    // seal the table once it's generated, see seal_table.
+    bool sealed;
+    
+    // a directory in which to keep sealed tables between runs, or NULL. see
+    // generate_table_with_options.
+    const char* cacheDir;
+    
+    // names the functions of the table for function_name, and may give their sizes
+    // while the table is generated, e.g. from the symbol table. Called with
+    // namerContext. May be NULL.
+    function_namer_t nameFunction;
+    void* namerContext;
+} table_options_t;
+
+// Called with the address of each root found by scan_frame, which the collector
+// may update to relocate the object.
+typedef void (*root_visitor_t)(void** root, void* context);
+
+// the addresses from start up to, but not including, end.
+typedef struct {
+    uintptr_t start;
+    uintptr_t end;
+} address_range_t;
+
+// see walk_stack_with_options
+typedef struct {
+    // only visit the roots pointing into one of these ranges, e.g. the nursery for a
+    // minor collection. every root is visited when numRanges is 0.
+    const address_range_t* ranges;
+    uint32_t numRanges;
+    
+    // prefetch the object each root points to this many roots before visiting it, up
+    // to STATEPOINT_MAX_PREFETCH_DISTANCE. 0 visits each root as it's found.
+    uint32_t prefetchDistance;
+} walk_options_t;
+
+#define STATEPOINT_MAX_PREFETCH_DISTANCE 64
+
+// a table being generated in the background, see start_table_build
+typedef struct table_build table_build_t;
+
+// A stack map record that is not a statepoint, e.g. of a patchpoint.
+typedef struct {
+    uint64_t address;   // the function's address plus the record's code offset, minus keyBase
+    uint64_t id;
+    uint64_t frameSize;
+    uint32_t numValues;
+    value_info_t values[];
+} patchpoint_info_t;
+
 typedef struct {
     uint64_t size; 
     table_bucket_t* buckets;
+    
+    // The return addresses stored in the table are relative to keyBase, which is 0
+    // unless the table was generated with a cacheDir, in which case it is the load
+    // address of the module holding the stack map. Lookups take absolute addresses.
+    uint64_t keyBase;
+    
+    // the stack map section the table was generated from, if any.
+    void* section;
+    size_t sectionLength;
+    
+    deopt_table_t* deopt;
+    
+    // frames sorted by statepoint ID, if the table was generated with recordIds.
+    uint64_t numIds;
+    id_entry_t* ids;
+    
+    // The sorted, distinct values of roots that LLVM described with a constant rather
+    // than a frame location, e.g. pointers to objects in the data section. They are
+    // live in every frame that mentions them, so scan them once per GC instead. They
+    // can't be relocated, since the constants are part of the compiled code.
+    uint64_t numStaticRoots;
+    uint64_t* staticRoots;
+    
+    // sorted by address, if the table was generated with indexPatchpoints.
+    uint64_t numPatchpoints;
+    patchpoint_info_t** patchpoints;
+    
+    // the functions of the stack map, sorted by address, see lookup_function.
+    uint64_t numFunctions;
+    function_entry_t* functions;
+    
+    table_options_t options;
+    
+    // the read-only mapping holding the contents of a sealed table, or NULL.
+    void* region;
+    size_t regionSize;
 } statepoint_table_t;
 
+// Counters of the work done by lookups and stack walks, kept per thread when the
+// library and its callers are compiled with STATEPOINT_STATS, see statepoint_stats.
+typedef struct {
+    uint64_t lookups;
+    uint64_t lookupHits;
+    uint64_t lookupMisses;
+    uint64_t entriesProbed;  // frames compared with the key, over all lookups
+    uint64_t framesScanned;
+    uint64_t rootsVisited;
+    uint64_t stacksWalked;
+    uint64_t walkNanos;      // total time spent in walk_stack
+    uint64_t maxWalkNanos;   // the longest walk_stack
+} statepoint_stats_t;
+
+// The kinds of events recorded when compiled with STATEPOINT_TRACE, see
+// statepoint_trace_dump.
+typedef enum {
+    TRACE_WALK_STACK = 1,   // a walk_stack, whose argument is the number of frames
+    TRACE_SCAN_FRAME = 2    // a scan of a large frame, whose argument is its number of slots
+} trace_event_kind_t;
+
+// a file of stacks being captured, see start_capture
+typedef struct stack_capture stack_capture_t;
+
+typedef enum {
+    CAPTURE_FRAMES = 0x1    // also capture the bytes of the frames, so the stacks can be walked
+} capture_flags_t;
+
+typedef struct {
+    uint64_t numFrames;
+    uint64_t* retAddrs;     // innermost first
+    
+    // with CAPTURE_FRAMES, a copy of the stack from the innermost return address up to
+    // and including the return address that ended the walk, and otherwise NULL.
+    uint8_t* stack;
+    uint64_t stackSize;
+} captured_stack_t;
+
+typedef struct {
+    uint32_t flags;         // the capture_flags_t the stacks were captured with
+    
+    // the stack map of the table the stacks were walked with, or empty if the table
+    // wasn't generated from one.
+    void* section;
+    size_t sectionLength;
+    
+    uint64_t numStacks;
+    captured_stack_t* stacks;
+} captured_stacks_t;
+
+
 
 
 /**** Public Functions ****/
@@ -81,6 +309,47 @@ typedef struct {
  */
 frame_info_t* lookup_return_address(statepoint_table_t *table, uint64_t retAddr);
 
+/**
+ * Visits the base pointers of the frame, given its base (see Figure 1). Derived pointers
+ * are not visited, but are kept at the same offset from their base pointer, so they
+ * follow it if it is relocated by the visitor.
+ */
+void scan_frame(frame_info_t* frame, uint8_t* base, root_visitor_t visit, void* context);
+
+/**
+ * Scans every frame on the stack with scan_frame, stopping at the first return address
+ * that is not in the table. stackPtr points to the return address of the first frame,
+ * i.e., it is the stack pointer right after a call into the collector.
+ */
+void walk_stack(statepoint_table_t* table, uint8_t* stackPtr, 
+                root_visitor_t visit, void* context);
+
+/**
+ * Sets the options to those of walk_stack, which visits every root.
+ */
+void default_walk_options(walk_options_t* options);
+
+/**
+ * Like walk_stack, but only visits the base pointers that point into one of
+ * options->ranges, if any. The bases of each frame are checked against the ranges in
+ * bulk, using AVX2 gathers when the CPU has them, and frames without any root to
+ * visit are otherwise left alone. Derived pointers still follow their bases.
+ *
+ * With options->prefetchDistance, the object of each root is prefetched as the root
+ * is found, and the root is visited that many roots later, across frames. Until the
+ * last root of a frame is visited, its derived pointers hold their offset from their
+ * base, so the visitor must not read the stack slots of other roots.
+ */
+void walk_stack_with_options(statepoint_table_t* table, uint8_t* stackPtr,
+                             root_visitor_t visit, void* context,
+                             const walk_options_t* options);
+
+/**
+ * Like scan_frame, with the options of walk_stack_with_options.
+ */
+void scan_frame_with_options(frame_info_t* frame, uint8_t* base, root_visitor_t visit,
+                             void* context, const walk_options_t* options);
+
 /**
  * Given an LLVM generated Stack Map, will returns a hash table mapping return addresses
  * to a frame_info_t struct that provides information about live pointer locations within
@@ -94,6 +363,157 @@ frame_info_t* lookup_return_address(statepoint_table_t *table, uint64_t retAddr)
  */
 statepoint_table_t* generate_table(void* map, float load_factor);
 
+/**
+ * Like generate_table, but accepts an entire stack map section of the given length
+ * in bytes. When many object files are linked together, the linker concatenates their
+ * stack maps, so the section holds several complete stack maps back to back. All of
+ * them are parsed, in parallel across stack maps, into a single table.
+ *
+ * Returns NULL if the section is malformed, or if the roots of a statepoint can't be
+ * described by a frame_info_t, e.g. when they are relative to a register other than
+ * the stack and frame pointers.
+ */
+statepoint_table_t* generate_table_from_section(void* section, size_t length, 
+                                                float load_factor);
+
+
+/**
+ * Sets the options to the defaults used by generate_table_from_section, with a
+ * load factor of 0.5.
+ */
+void default_table_options(table_options_t* options);
+
+/**
+ * Same as generate_table_from_section, but with extra options.
+ *
+ * If options->cacheDir is set, the table is identified by the GNU build-id of the
+ * module holding the section, or by a hash of the section if there is none, together
+ * with the options. A table cached in the directory by an earlier run is mapped
+ * straight from its file instead of being generated. Otherwise the table is generated,
+ * sealed, and written to the directory for the next run. Tables from the cache are
+ * sealed too, and are shared through the page cache by every process that maps them.
+ */
+statepoint_table_t* generate_table_with_options(void* section, size_t length,
+                                                table_options_t* options);
+
+/**
+ * Starts generating a table with generate_table_with_options on a background
+ * thread, e.g. at program startup, so that the first GC need not pay for it.
+ * The section must stay valid until the build finishes.
+ */
+table_build_t* start_table_build(void* section, size_t length, table_options_t* options);
+
+/**
+ * Returns the table of the build, waiting for the build to finish if needed. It is
+ * safe to call from any number of threads, and is cheap once the build has finished.
+ * Returns NULL if the section was malformed.
+ */
+statepoint_table_t* await_table(table_build_t* build);
+
+/**
+ * Same as await_table, but returns NULL instead of waiting if the build hasn't finished.
+ */
+statepoint_table_t* try_await_table(table_build_t* build);
+
+/**
+ * Waits for the build's thread and frees the build, but not its table.
+ */
+void destroy_table_build(table_build_t* build);
+
+/**
+ * The process-wide table, for runtimes where more than one thread may trigger a GC.
+ *
+ * init_global_table generates it from the section on first use, and returns it.
+ * Only the first call's arguments are used, and concurrent callers wait for it.
+ * start_global_table does the same in the background, without waiting for it.
+ *
+ * global_table returns the table, waiting for its build if it has been started, or
+ * NULL if neither init function has been called. Once the table has been published,
+ * this is a single acquire load.
+ *
+ * destroy_global_table frees the table, and must not race with any use of it.
+ */
+statepoint_table_t* init_global_table(void* section, size_t length, table_options_t* options);
+
+void start_global_table(void* section, size_t length, table_options_t* options);
+
+statepoint_table_t* global_table(void);
+
+void destroy_global_table(void);
+
+/**
+ * Moves everything reachable from the table, other than the deopt index, into one
+ * shared anonymous mapping that is then made read-only. Build the table before
+ * forking, and all children will share its pages for their whole lifetime, since
+ * neither copy-on-write nor the allocator ever touches them.
+ *
+ * Sealed tables can't be modified with insert_key. Returns false if the mapping
+ * couldn't be created, in which case the table is left as it was.
+ */
+bool seal_table(statepoint_table_t* table);
+
+/**
+ * Returns a pointer to the statepoint ID recorded in the frame, or NULL if the
+ * table was generated without recordIds.
+ */
+uint64_t* frame_statepoint_id(frame_info_t* frame);
+
+/**
+ * Returns the frame's user data, or NULL if the table was generated without
+ * options.userDataSize. It's options.userDataSize bytes, rounded up to a multiple of
+ * 8 and 8-byte aligned, and zeroed when the table is generated, for the collector to
+ * keep whatever it derives from the frame, so that the frame found by a lookup comes
+ * with it. Frames inserted by hand with insert_key have none.
+ *
+ * The user data of a sealed table is read-only. To keep some in one, generate the
+ * table unsealed, fill it in, then call seal_table.
+ */
+void* frame_user_data(frame_info_t* frame);
+
+/**
+ * Finds the frames of the callsites with the given statepoint ID, which need not be
+ * unique, in O(log n) time. Returns the first matching entry of table->ids and sets
+ * count to the number of consecutive matching entries, or returns NULL if there are none.
+ *
+ * Frame pointers in the ID index are invalidated by a later insert_key.
+ */
+id_entry_t* lookup_statepoint_id(statepoint_table_t* table, uint64_t id, uint64_t* count);
+
+/**
+ * Finds the record at the given address that was classified as not being a statepoint,
+ * in O(log n) time. Returns NULL if there is none, or the table was generated without
+ * indexPatchpoints.
+ */
+patchpoint_info_t* lookup_patchpoint(statepoint_table_t* table, uint64_t address);
+
+/**
+ * Finds the function with statepoints that holds the given address, e.g. a return
+ * address, in O(log n) time, or returns NULL if there is none. The stack map doesn't
+ * give the sizes of functions, so unless options.nameFunction gave it, a function is
+ * taken to span up to the next function of the same stack map, or just past its last
+ * return address if it's the last one. Return addresses in the table always map to
+ * the right function.
+ */
+function_entry_t* lookup_function(statepoint_table_t* table, uint64_t address);
+
+/**
+ * Returns the name of the function as given by options.nameFunction, or NULL if the
+ * table was generated without one or it doesn't know the function.
+ */
+const char* function_name(statepoint_table_t* table, function_entry_t* fn);
+
+/**
+ * Returns the locations of the deopt values recorded at the given return address,
+ * or NULL if the callsite has no deopt values or is not in the table.
+ *
+ * The index of deopt values is built on the first call from the stack map the table
+ * was generated from, and is keyed like the table itself, so that later lookups are
+ * amortized O(1) as well. Tables filled only by insert_key have no deopt values.
+ * Since this may happen during a deoptimization, locations the tables can't describe
+ * are given as VALUE_UNKNOWN, or relative to their register, rather than failing.
+ */
+deopt_info_t* lookup_deopt_state(statepoint_table_t* table, uint64_t retAddr);
+
 
 /**
  * Frees _all_ allocated memory reachable from the table. Thus, any
@@ -105,11 +525,92 @@ void destroy_table(statepoint_table_t* table);
 /* Insert a custom key value pair.
    NOTE the value _must_ be a malloc'd pointer, because insert_key
    will attempt to free it after it's been inserted.
+   The key and value->retAddr are relative to table->keyBase.
  */
 void insert_key (statepoint_table_t* table, uint64_t key, frame_info_t* value);
 
 
 
+/**
+ * Collects the return addresses of the managed frames on a stack, innermost first,
+ * into retAddrs, and returns their number. It is async-signal-safe, so a SIGPROF
+ * handler can unwind managed code without frame pointers or DWARF: it takes no locks,
+ * allocates nothing, and does at most maxScan + maxFrames lookups.
+ *
+ * The stack is only read within [stackPtr, stackEnd), where stackEnd is the high end
+ * of the interrupted thread's stack, see thread_stack_bounds. Since stackPtr need not
+ * point to a return address, e.g. when the thread was interrupted in the middle of a
+ * function, the walk starts at the first return address in the table among the
+ * maxScan words from stackPtr up. It then follows frames like walk_stack, and stops
+ * early at a frame that would leave the bounds.
+ *
+ * The table must already be built, e.g. read from a variable set once await_table
+ * returned, and must not be changed by insert_key meanwhile.
+ */
+uint64_t sample_stack(statepoint_table_t* table, uint8_t* stackPtr, uint8_t* stackEnd,
+                      uint64_t maxScan, uint64_t* retAddrs, uint64_t maxFrames);
+
+/**
+ * Sets low and high to the bounds of the calling thread's stack, or returns false if
+ * they can't be found. Not async-signal-safe, so call it when a thread starts and keep
+ * the bounds for its signal handler.
+ */
+bool thread_stack_bounds(uint8_t** low, uint8_t** high);
+
+/**
+ * Captures stacks as they are walked, so that lookups and walks can be replayed later
+ * against other tables, see bench/replay.c. The file holds the table's stack map, and
+ * for each call of capture_stack, the return addresses of the frames walk_stack would
+ * visit, plus the bytes of the frames if flags has CAPTURE_FRAMES. Return addresses are
+ * captured as they are, so a replay's tables must be generated from the captured stack
+ * map rather than from a new run of the program.
+ *
+ * start_capture returns NULL if the file couldn't be created. capture_stack may be
+ * called from any number of threads, and returns false if the file couldn't be
+ * written. finish_capture closes the file, returning false if any write failed.
+ */
+stack_capture_t* start_capture(statepoint_table_t* table, const char* path, uint32_t flags);
+
+bool capture_stack(stack_capture_t* capture, uint8_t* stackPtr);
+
+bool finish_capture(stack_capture_t* capture);
+
+/**
+ * Reads a file written by start_capture, returning NULL if it can't be read or is
+ * malformed. Files are only readable on machines with the byte order of the machine
+ * that captured them.
+ */
+captured_stacks_t* load_captured_stacks(const char* path);
+
+void destroy_captured_stacks(captured_stacks_t* stacks);
+
+/**
+ * Sets total to the sum of the counters of all threads, including threads that have
+ * exited, and returns the number of threads that are still counting. The counts are
+ * all 0 unless the code doing the lookups was compiled with STATEPOINT_STATS, and
+ * the counts of other threads may lag slightly behind.
+ */
+uint64_t statepoint_stats(statepoint_stats_t* total);
+
+// Sets stats to the counters of the calling thread.
+void statepoint_thread_stats(statepoint_stats_t* stats);
+
+/**
+ * Writes the events recorded by all running threads as Chrome trace JSON, which
+ * chrome://tracing and Perfetto can show as a timeline per thread. Each thread keeps
+ * its most recent events in a ring buffer of its own, and threads are numbered in the
+ * order they recorded their first event or count. Events are only recorded by code
+ * compiled with STATEPOINT_TRACE. Returns false if the stream couldn't be written.
+ */
+bool statepoint_trace_dump(FILE* stream);
+
+// used by the instrumentation below.
+statepoint_stats_t* statepoint_register_thread(void);
+uint64_t statepoint_stats_clock(void);
+void statepoint_trace_event(uint32_t kind, uint64_t start, uint64_t end, uint64_t arg);
+
+
+
 /**** Debugging Functions ****/
 
 // skip_empty will skip printing out empty buckets
@@ -118,6 +619,196 @@ void print_table(FILE *stream, statepoint_table_t* table, bool skip_empty);
 // the function print_table uses to print an individual frame, useful for debugging.
 void print_frame(FILE *stream, frame_info_t* frame);
 
+void print_deopt_state(FILE *stream, deopt_info_t* deopt);
+
+
+
+/**** Inline Fast Paths ****/
+
+/* The functions used on every frame of a stack scan, defined here so that the
+   compiler can inline them into the caller's own loops. lookup_return_address,
+   scan_frame and walk_stack are the out-of-line versions of the same code. */
+
+#ifdef STATEPOINT_STATS
+    // the calling thread's counters, or NULL before its first count.
+    extern __thread statepoint_stats_t* statepointThreadStats;
+    
+    static inline statepoint_stats_t* statepoint_local_stats(void) {
+        statepoint_stats_t* stats = statepointThreadStats;
+        return stats != NULL ? stats : statepoint_register_thread();
+    }
+    
+    // only the owning thread writes its counters, so there is no need for an atomic
+    // add, but the loads and stores must be atomic for statepoint_stats.
+    #define STATEPOINT_STAT_ADD(field, n) do { \
+        statepoint_stats_t* stats_ = statepoint_local_stats(); \
+        __atomic_store_n(&stats_->field, \
+            __atomic_load_n(&stats_->field, __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED); \
+    } while(0)
+    
+    #define STATEPOINT_STAT_MAX(field, n) do { \
+        statepoint_stats_t* stats_ = statepoint_local_stats(); \
+        if((n) > __atomic_load_n(&stats_->field, __ATOMIC_RELAXED)) { \
+            __atomic_store_n(&stats_->field, (n), __ATOMIC_RELAXED); \
+        } \
+    } while(0)
+    
+#else
+    #define STATEPOINT_STAT_ADD(field, n) ((void)0)
+    #define STATEPOINT_STAT_MAX(field, n) ((void)0)
+#endif
+
+#ifdef STATEPOINT_TRACE
+    // frames with at least this many slots get an event of their own.
+    #ifndef STATEPOINT_TRACE_LARGE_FRAME
+    #define STATEPOINT_TRACE_LARGE_FRAME 64
+    #endif
+    
+    #define STATEPOINT_TRACE_START(traced) ((traced) ? statepoint_stats_clock() : 0)
+    #define STATEPOINT_TRACE_EVENT(kind, start, end, arg) \
+        statepoint_trace_event((kind), (start), (end), (arg))
+#else
+    #define STATEPOINT_TRACE_LARGE_FRAME UINT32_MAX
+    #define STATEPOINT_TRACE_START(traced) ((uint64_t)0)
+    #define STATEPOINT_TRACE_EVENT(kind, start, end, arg) ((void)0)
+#endif
+
+#if defined(STATEPOINT_STATS) || defined(STATEPOINT_TRACE)
+    #define STATEPOINT_CLOCK() statepoint_stats_clock()
+#else
+    #define STATEPOINT_CLOCK() ((uint64_t)0)
+#endif
+
+/**
+ * The hash function used to distribute keys uniformly across the table.
+ * The implementation is one round of the xorshift64* algorithm.
+ * Code Source: Wikipedia
+ */
+static inline uint64_t statepoint_hash(uint64_t x) {
+    x ^= x >> 12; // a
+    x ^= x << 25; // b
+    x ^= x >> 27; // c
+    return x * UINT64_C(2685821657736338717);
+}
+
+// optional data after the slots is 8-byte aligned.
+static inline size_t statepoint_offset_of_extras(uint32_t numSlots) {
+    size_t end = offsetof(frame_info_t, slots) + numSlots * sizeof(pointer_slot_t);
+    return (end + 7) & ~((size_t)0x7);
+}
+
+// the size of the frame in its bucket, including optional data.
+static inline size_t statepoint_frame_size(frame_info_t* frame) {
+    size_t size = statepoint_offset_of_extras(frame->numSlots);
+    if(frame->flags & FRAME_HAS_ID) {
+        size += sizeof(uint64_t);
+    }
+    size += (size_t)(frame->flags >> FRAME_USER_DATA_SHIFT) * sizeof(uint64_t);
+    return size;
+}
+
+// see frame_user_data
+static inline void* statepoint_user_data(frame_info_t* frame) {
+    if((frame->flags >> FRAME_USER_DATA_SHIFT) == 0) {
+        return NULL;
+    }
+    size_t offset = statepoint_offset_of_extras(frame->numSlots);
+    if(frame->flags & FRAME_HAS_ID) {
+        offset += sizeof(uint64_t);
+    }
+    return ((uint8_t*)frame) + offset;
+}
+
+static inline frame_info_t* lookup_return_address_inline(statepoint_table_t* table, 
+                                                          uint64_t retAddr) {
+    retAddr -= table->keyBase;
+    
+    // Using modulo may introduce a little bias in the table. 
+    // If you care, use the unbiased version that's floating around the internet.
+    table_bucket_t* bucket = table->buckets + statepoint_hash(retAddr) % table->size;
+    
+    uint32_t bucketLimit = bucket->numEntries;
+    frame_info_t* entries = bucket->entries;
+    
+    STATEPOINT_STAT_ADD(lookups, 1);
+    for(uint32_t i = 0; i < bucketLimit; i++) {
+        if(entries->retAddr == retAddr) {
+            STATEPOINT_STAT_ADD(entriesProbed, i + 1);
+            STATEPOINT_STAT_ADD(lookupHits, 1);
+            return entries;
+        }
+        entries = (frame_info_t*)(((uint8_t*)entries) + statepoint_frame_size(entries));
+    }
+    
+    STATEPOINT_STAT_ADD(entriesProbed, bucketLimit);
+    STATEPOINT_STAT_ADD(lookupMisses, 1);
+    return NULL;
+}
+
+static inline void scan_frame_inline(frame_info_t* frame, uint8_t* base, 
+                                     root_visitor_t visit, void* context) {
+    uint32_t numSlots = frame->numSlots;
+    pointer_slot_t* slots = frame->slots;
+    
+    // bases come first, so the derived pointers start where they end.
+    uint32_t numBases = 0;
+    while(numBases < numSlots && slots[numBases].kind < 0) {
+        numBases++;
+    }
+    STATEPOINT_STAT_ADD(framesScanned, 1);
+    STATEPOINT_STAT_ADD(rootsVisited, numBases);
+    
+    bool traced = numSlots >= STATEPOINT_TRACE_LARGE_FRAME;
+    uint64_t start = STATEPOINT_TRACE_START(traced);
+    
+    // while the bases are visited, derived pointers hold their offset from the base.
+    for(uint32_t i = numBases; i < numSlots; i++) {
+        uintptr_t* derived = (uintptr_t*)(base + slots[i].offset);
+        *derived -= *(uintptr_t*)(base + slots[slots[i].kind].offset);
+    }
+    
+    for(uint32_t i = 0; i < numBases; i++) {
+        visit((void**)(base + slots[i].offset), context);
+    }
+    
+    for(uint32_t i = numBases; i < numSlots; i++) {
+        uintptr_t* derived = (uintptr_t*)(base + slots[i].offset);
+        *derived += *(uintptr_t*)(base + slots[slots[i].kind].offset);
+    }
+    
+    if(traced) {
+        STATEPOINT_TRACE_EVENT(TRACE_SCAN_FRAME, start, STATEPOINT_CLOCK(), numSlots);
+    }
+    (void)start;
+}
+
+static inline void walk_stack_inline(statepoint_table_t* table, uint8_t* stackPtr, 
+                                     root_visitor_t visit, void* context) {
+    uint64_t start = STATEPOINT_CLOCK();
+    uint64_t numFrames = 0;
+    
+    // see Figure 1
+    frame_info_t* frame = lookup_return_address_inline(table, *(uint64_t*)stackPtr);
+    
+    while(frame != NULL) {
+        uint8_t* base = stackPtr + sizeof(void*);
+        scan_frame_inline(frame, base, visit, context);
+        numFrames++;
+        
+        stackPtr = base + frame->frameSize;
+        frame = lookup_return_address_inline(table, *(uint64_t*)stackPtr);
+    }
+    
+    uint64_t end = STATEPOINT_CLOCK();
+    STATEPOINT_STAT_ADD(stacksWalked, 1);
+    STATEPOINT_STAT_ADD(walkNanos, end - start);
+    STATEPOINT_STAT_MAX(maxWalkNanos, end - start);
+    STATEPOINT_TRACE_EVENT(TRACE_WALK_STACK, start, end, numFrames);
+    (void)start;
+    (void)end;
+    (void)numFrames;
+}
+
 #ifdef __cplusplus
   } /* end of extern C */
 #endif
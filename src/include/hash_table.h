@@ -10,17 +10,82 @@
 #include <stdlib.h>
 #include <string.h>
 
+/** Types **/
+
+typedef struct {
+    uint32_t numEntries;
+    size_t sizeOfEntries;
+    deopt_info_t* entries;
+} deopt_bucket_t;
+
+// has as many buckets as the statepoint table it belongs to, so a return address
+// hashes to the same bucket index in both.
+struct deopt_table {
+    uint64_t size;
+    deopt_bucket_t* buckets;
+};
+
+// see trace.c
+typedef struct trace_ring trace_ring_t;
+
+// The instrumentation of a thread, see stats.c
+typedef struct thread_block {
+    statepoint_stats_t stats;
+    trace_ring_t* trace;        // allocated on the thread's first event
+    uint64_t threadId;
+    struct thread_block* next;
+} thread_block_t;
+
 /** Functions **/
 
+uint64_t hashFn(uint64_t x);
+
+uint64_t computeBucketIndex(statepoint_table_t* table, uint64_t key);
+
 statepoint_table_t* new_table(float loadFactor, uint64_t expectedElms);
 
 /* lookup_return_address & insert_key is declared in api.h */
 
-size_t size_of_frame(uint16_t numSlots);
+size_t size_of_frame(uint32_t numSlots, uint16_t flags);
 
 size_t frame_size(frame_info_t* frame);
 
 // returns the next frame relative the current frame
 frame_info_t* next_frame(frame_info_t* cur);
 
+void destroy_deopt_table(deopt_table_t* deopt);
+
+// builds table->ids from the frames in the table.
+void build_id_index(statepoint_table_t* table);
+
+uint64_t fill_id_index(statepoint_table_t* table, id_entry_t* ids);
+
+size_t size_of_patchpoint(uint32_t numValues);
+
+void unmap_region(void* region, size_t size);
+
+// the function index, see functions.c
+void sort_functions(function_entry_t* functions, uint64_t numFunctions);
+
+void size_functions(statepoint_table_t* table, function_entry_t* functions,
+                    uint64_t numFunctions);
+
+void build_function_index(statepoint_table_t* table);
+
+// the on-disk table cache, see cache.c
+uint64_t module_key_base(void* section);
+
+statepoint_table_t* load_cached_table(void* section, size_t length, 
+                                      table_options_t* options);
+
+void store_cached_table(statepoint_table_t* table);
+
+// the calling thread's block, registering it if needed.
+thread_block_t* current_thread_block(void);
+
+// calls fn on the block of every running thread, which can't exit meanwhile.
+void for_each_thread_block(void (*fn)(thread_block_t* block, void* arg), void* arg);
+
+void free_trace_ring(trace_ring_t* ring);
+
 #endif /* __LLVM_STATEPOINT_UTILS_HASH_TABLE__ */
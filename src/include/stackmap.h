@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 /** 
  * LLVM's Documentation: http://llvm.org/docs/StackMaps.html#stack-map-format
@@ -94,4 +95,48 @@ typedef struct __attribute__((packed)) {
     uint8_t size;       // in bytes
 } liveout_location_t;
 
+/** Parsing **/
+
+// Walks the callsite records of a stack map in order, along with the function
+// each callsite belongs to.
+typedef struct {
+    function_info_t* fn;
+    callsite_header_t* callsite;
+    uint64_t visited;     // number of fn's callsites visited so far
+    uint64_t remaining;   // number of callsites left, including the current one
+} callsite_iter_t;
+
+void callsite_iter_init(callsite_iter_t* iter, stackmap_header_t* header);
+
+void callsite_iter_next(callsite_iter_t* iter);
+
+// the record after the given one, or NULL if it runs past end, see generate.c
+callsite_header_t* next_callsite(callsite_header_t* callsite, uint8_t* end);
+
+// the constant pool, which ConstIndex locations refer to.
+uint64_t* stackmap_constants(stackmap_header_t* header);
+
+value_location_t* deopt_locations(callsite_header_t* callsite, int32_t* numDeopt);
+
+bool is_statepoint(callsite_header_t* callsite, table_options_t* options);
+
+void decode_location(value_location_t* loc, uint64_t frameSize,
+                     uint64_t* constants, uint32_t numConstants, value_info_t* out);
+
+patchpoint_info_t* generate_patchpoint_info(callsite_header_t* callsite, function_info_t* fn,
+                                            uint64_t* constants, uint32_t numConstants);
+
+void sort_patchpoints(statepoint_table_t* table);
+
+bool frame_relative(value_location_t* p);
+
+int32_t convert_offset(value_location_t* p, uint64_t frameSize);
+
+// the first byte after the stack map, or NULL if it runs past end, see generate.c
+uint8_t* end_of_blob(stackmap_header_t* header, uint8_t* end);
+
+// Splits a section into its stack maps, see generate.c
+int64_t split_section(uint8_t* cur, uint8_t* end, 
+                      stackmap_header_t** blobs, uint64_t* numCallsites);
+
 #endif /* __LLVM_STATEPOINT_UTILS_STACKMAP__ */
@@ -0,0 +1,180 @@
+#ifndef __LLVM_STATEPOINT_UTILS_CPP__
+#define __LLVM_STATEPOINT_UTILS_CPP__
+
+#include "api.h"
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * A header-only C++ interface to the tables of api.h, for collectors written in C++.
+ *
+ * The walks are templates over the visitor, so unlike walk_stack, the visitor is
+ * inlined into the loop over the slots rather than called through a pointer. Nothing
+ * here allocates or uses virtual calls.
+ *
+ *     statepoint::walk(table, stackPtr, [&](void** root) { *root = copy(*root); });
+ *
+ *     for(statepoint::stack_frame frame : statepoint::frames(table, stackPtr)) {
+ *         for(const pointer_slot_t& slot : frame.slots()) { ... frame.root(slot) ... }
+ *     }
+ */
+
+namespace statepoint {
+
+// The slots of a frame, bases first.
+class slot_range {
+public:
+    explicit slot_range(frame_info_t* frame) : frame_(frame) {}
+
+    const pointer_slot_t* begin() const { return frame_->slots; }
+    const pointer_slot_t* end() const { return frame_->slots + frame_->numSlots; }
+    std::size_t size() const { return frame_->numSlots; }
+
+private:
+    frame_info_t* frame_;
+};
+
+// A frame found on the stack: its description, and its base (see Figure 1 in api.h).
+struct stack_frame {
+    frame_info_t* info;
+    uint8_t* base;
+
+    slot_range slots() const { return slot_range(info); }
+
+    // the location of the pointer described by the slot
+    void** root(const pointer_slot_t& slot) const {
+        return reinterpret_cast<void**>(base + slot.offset);
+    }
+
+    bool is_base(const pointer_slot_t& slot) const { return slot.kind < 0; }
+
+    // see frame_user_data
+    void* user_data() const { return statepoint_user_data(info); }
+
+    // the base pointer a derived pointer was derived from
+    void** base_of(const pointer_slot_t& slot) const {
+        return root(info->slots[slot.kind]);
+    }
+};
+
+// Walks up the stack from the return address at stackPtr, stopping at the first
+// return address that is not in the table, like walk_stack.
+class frame_iterator {
+public:
+    frame_iterator() : table_(nullptr), stackPtr_(nullptr), frame_(nullptr) {}
+
+    frame_iterator(statepoint_table_t* table, uint8_t* stackPtr)
+        : table_(table), stackPtr_(stackPtr) {
+        find_frame();
+    }
+
+    stack_frame operator*() const {
+        stack_frame frame = { frame_, stackPtr_ + sizeof(void*) };
+        return frame;
+    }
+
+    frame_iterator& operator++() {
+        stackPtr_ += sizeof(void*) + frame_->frameSize;
+        find_frame();
+        return *this;
+    }
+
+    // all iterators past the last frame are equal
+    bool operator==(const frame_iterator& other) const {
+        return frame_ == nullptr ? other.frame_ == nullptr
+                                 : stackPtr_ == other.stackPtr_ && frame_ == other.frame_;
+    }
+
+    bool operator!=(const frame_iterator& other) const { return !(*this == other); }
+
+private:
+    void find_frame() {
+        uint64_t retAddr = *reinterpret_cast<uint64_t*>(stackPtr_);
+        frame_ = lookup_return_address_inline(table_, retAddr);
+    }
+
+    statepoint_table_t* table_;
+    uint8_t* stackPtr_;
+    frame_info_t* frame_;
+};
+
+class stack_range {
+public:
+    stack_range(statepoint_table_t* table, uint8_t* stackPtr)
+        : table_(table), stackPtr_(stackPtr) {}
+
+    frame_iterator begin() const { return frame_iterator(table_, stackPtr_); }
+    frame_iterator end() const { return frame_iterator(); }
+
+private:
+    statepoint_table_t* table_;
+    uint8_t* stackPtr_;
+};
+
+// The frames on the stack, see frame_iterator.
+inline stack_range frames(statepoint_table_t* table, uint8_t* stackPtr) {
+    return stack_range(table, stackPtr);
+}
+
+// Same as scan_frame, calling visit(void** root) for each base pointer.
+template<typename Visitor>
+inline void scan(const stack_frame& frame, Visitor&& visit) {
+    const pointer_slot_t* slots = frame.info->slots;
+    uint32_t numSlots = frame.info->numSlots;
+
+    // bases come first, so the derived pointers start where they end.
+    uint32_t numBases = 0;
+    while(numBases < numSlots && slots[numBases].kind < 0) {
+        numBases++;
+    }
+    STATEPOINT_STAT_ADD(framesScanned, 1);
+    STATEPOINT_STAT_ADD(rootsVisited, numBases);
+
+    bool traced = numSlots >= STATEPOINT_TRACE_LARGE_FRAME;
+    uint64_t start = STATEPOINT_TRACE_START(traced);
+
+    for(uint32_t i = numBases; i < numSlots; i++) {
+        *reinterpret_cast<uintptr_t*>(frame.root(slots[i])) -=
+            *reinterpret_cast<uintptr_t*>(frame.base_of(slots[i]));
+    }
+
+    for(uint32_t i = 0; i < numBases; i++) {
+        visit(frame.root(slots[i]));
+    }
+
+    for(uint32_t i = numBases; i < numSlots; i++) {
+        *reinterpret_cast<uintptr_t*>(frame.root(slots[i])) +=
+            *reinterpret_cast<uintptr_t*>(frame.base_of(slots[i]));
+    }
+
+    if(traced) {
+        STATEPOINT_TRACE_EVENT(TRACE_SCAN_FRAME, start, STATEPOINT_CLOCK(), numSlots);
+    }
+    (void)start;
+}
+
+// Same as walk_stack, calling visit(void** root) for each base pointer.
+template<typename Visitor>
+inline void walk(statepoint_table_t* table, uint8_t* stackPtr, Visitor&& visit) {
+    uint64_t start = STATEPOINT_CLOCK();
+    uint64_t numFrames = 0;
+    
+    for(stack_frame frame : frames(table, stackPtr)) {
+        scan(frame, visit);
+        numFrames++;
+    }
+    
+    uint64_t end = STATEPOINT_CLOCK();
+    STATEPOINT_STAT_ADD(stacksWalked, 1);
+    STATEPOINT_STAT_ADD(walkNanos, end - start);
+    STATEPOINT_STAT_MAX(maxWalkNanos, end - start);
+    STATEPOINT_TRACE_EVENT(TRACE_WALK_STACK, start, end, numFrames);
+    (void)start;
+    (void)end;
+    (void)numFrames;
+}
+
+} // namespace statepoint
+
+#endif /* __LLVM_STATEPOINT_UTILS_CPP__ */
@@ -0,0 +1,57 @@
+#include "include/api.h"
+#include "include/stackmap.h"
+#include "include/hash_table.h"
+
+size_t size_of_patchpoint(uint32_t numValues) {
+    return sizeof(patchpoint_info_t) + numValues * sizeof(value_info_t);
+}
+
+patchpoint_info_t* generate_patchpoint_info(callsite_header_t* callsite, function_info_t* fn,
+                                            uint64_t* constants, uint32_t numConstants) {
+    uint16_t numLocations = callsite->numLocations;
+    value_location_t* locations = (value_location_t*)(callsite + 1);
+    
+    patchpoint_info_t* patchpoint = malloc(size_of_patchpoint(numLocations));
+    assert(patchpoint && "bad alloc");
+    
+    patchpoint->address = fn->address + callsite->codeOffset;
+    patchpoint->id = callsite->id;
+    patchpoint->frameSize = fn->stackSize;
+    patchpoint->numValues = numLocations;
+    
+    for(uint16_t i = 0; i < numLocations; i++) {
+        decode_location(locations + i, fn->stackSize, constants, numConstants,
+                        patchpoint->values + i);
+    }
+    
+    return patchpoint;
+}
+
+int compare_patchpoints(const void* a, const void* b) {
+    uint64_t x = (*(patchpoint_info_t* const*)a)->address;
+    uint64_t y = (*(patchpoint_info_t* const*)b)->address;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+void sort_patchpoints(statepoint_table_t* table) {
+    qsort(table->patchpoints, table->numPatchpoints, sizeof(patchpoint_info_t*), 
+          compare_patchpoints);
+}
+
+patchpoint_info_t* lookup_patchpoint(statepoint_table_t* table, uint64_t address) {
+    address -= table->keyBase;
+    uint64_t lo = 0;
+    uint64_t hi = table->numPatchpoints;
+    while(lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        uint64_t midAddress = table->patchpoints[mid]->address;
+        if(midAddress == address) {
+            return table->patchpoints[mid];
+        } else if(midAddress < address) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
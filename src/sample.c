@@ -0,0 +1,85 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // for pthread_getattr_np
+#endif
+
+#include "include/api.h"
+#include "include/hash_table.h"
+
+#include <pthread.h>
+
+/*
+   sample_stack runs in signal handlers, so it must not lock, allocate, or touch the
+   per-thread instrumentation, which registers threads on first use. It uses its own
+   copy of the lookup for that reason, and reads nothing outside the given bounds.
+*/
+
+frame_info_t* lookup_uninstrumented(statepoint_table_t* table, uint64_t retAddr) {
+    retAddr -= table->keyBase;
+    table_bucket_t* bucket = table->buckets + statepoint_hash(retAddr) % table->size;
+
+    frame_info_t* entries = bucket->entries;
+    for(uint32_t i = 0; i < bucket->numEntries; i++) {
+        if(entries->retAddr == retAddr) {
+            return entries;
+        }
+        entries = (frame_info_t*)(((uint8_t*)entries) + statepoint_frame_size(entries));
+    }
+    return NULL;
+}
+
+uint64_t sample_stack(statepoint_table_t* table, uint8_t* stackPtr, uint8_t* stackEnd,
+                      uint64_t maxScan, uint64_t* retAddrs, uint64_t maxFrames) {
+    if(table == NULL || table->size == 0 || stackPtr >= stackEnd) {
+        return 0;
+    }
+
+    // word-aligned, so every read is of a whole word within the bounds.
+    uintptr_t cur = ((uintptr_t)stackPtr + 7) & ~((uintptr_t)0x7);
+    uintptr_t end = (uintptr_t)stackEnd;
+
+    // the first return address above stackPtr, skipping whatever was interrupted.
+    frame_info_t* frame = NULL;
+    for(uint64_t i = 0; i < maxScan && cur < end && end - cur >= sizeof(uint64_t); i++) {
+        frame = lookup_uninstrumented(table, *(uint64_t*)cur);
+        if(frame != NULL) {
+            break;
+        }
+        cur += sizeof(uint64_t);
+    }
+
+    // then the same walk as walk_stack, see Figure 1
+    uint64_t numFrames = 0;
+    while(frame != NULL && numFrames < maxFrames) {
+        retAddrs[numFrames++] = *(uint64_t*)cur;
+
+        // a corrupt frame size must neither take us out of bounds nor wrap around.
+        uint64_t frameSize = frame->frameSize;
+        if((frameSize & 0x7) != 0 || frameSize >= end - cur - sizeof(uint64_t)) {
+            break;
+        }
+        cur += sizeof(uint64_t) + frameSize;
+        if(end - cur < sizeof(uint64_t)) {
+            break;
+        }
+        frame = lookup_uninstrumented(table, *(uint64_t*)cur);
+    }
+
+    return numFrames;
+}
+
+bool thread_stack_bounds(uint8_t** low, uint8_t** high) {
+    pthread_attr_t attr;
+    if(pthread_getattr_np(pthread_self(), &attr) != 0) {
+        return false;
+    }
+
+    void* addr;
+    size_t size;
+    bool ok = pthread_attr_getstack(&attr, &addr, &size) == 0;
+    pthread_attr_destroy(&attr);
+    if(ok) {
+        *low = (uint8_t*)addr;
+        *high = (uint8_t*)addr + size;
+    }
+    return ok;
+}
@@ -0,0 +1,13 @@
+#include "include/api.h"
+#include "include/hash_table.h"
+
+// see the inline versions in api.h
+
+void scan_frame(frame_info_t* frame, uint8_t* base, root_visitor_t visit, void* context) {
+    scan_frame_inline(frame, base, visit, context);
+}
+
+void walk_stack(statepoint_table_t* table, uint8_t* stackPtr, 
+                root_visitor_t visit, void* context) {
+    walk_stack_inline(table, stackPtr, visit, context);
+}
@@ -0,0 +1,131 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE     // for MAP_ANONYMOUS
+#endif
+
+#include "include/api.h"
+#include "include/stackmap.h"
+#include "include/hash_table.h"
+
+#include <sys/mman.h>
+
+/*
+   A sealed table keeps everything reachable from it, other than the lazily built
+   deopt index, in one shared, read-only mapping. The table header itself stays in
+   ordinary memory, since it is tiny and the deopt index is published through it.
+   
+   Layout of the region, with each part 8-byte aligned:
+   
+     table_bucket_t[size];
+     the entries of each bucket, in bucket order;
+     id_entry_t[numIds];
+     uint64_t[numStaticRoots];
+     function_entry_t[numFunctions];
+     patchpoint_info_t*[numPatchpoints];
+     each patchpoint_info_t, in address order;
+*/
+
+size_t align_to_8(size_t n) {
+    return (n + 7) & ~((size_t)0x7);
+}
+
+size_t sealed_size(statepoint_table_t* table) {
+    size_t size = align_to_8(table->size * sizeof(table_bucket_t));
+    for(uint64_t i = 0; i < table->size; i++) {
+        size += align_to_8(table->buckets[i].sizeOfEntries);
+    }
+    
+    size += table->numIds * sizeof(id_entry_t);
+    size += table->numStaticRoots * sizeof(uint64_t);
+    size += table->numFunctions * sizeof(function_entry_t);
+    size += table->numPatchpoints * sizeof(patchpoint_info_t*);
+    for(uint64_t i = 0; i < table->numPatchpoints; i++) {
+        size += align_to_8(size_of_patchpoint(table->patchpoints[i]->numValues));
+    }
+    
+    return size;
+}
+
+// Moves the contents of the table into the region, freeing the old copies.
+void move_into_region(statepoint_table_t* table, uint8_t* region) {
+    uint8_t* cur = region;
+    
+    table_bucket_t* buckets = (table_bucket_t*)cur;
+    memcpy(buckets, table->buckets, table->size * sizeof(table_bucket_t));
+    cur += align_to_8(table->size * sizeof(table_bucket_t));
+    
+    for(uint64_t i = 0; i < table->size; i++) {
+        table_bucket_t* bucket = buckets + i;
+        if(bucket->entries == NULL) {
+            continue;
+        }
+        memcpy(cur, bucket->entries, bucket->sizeOfEntries);
+        free(bucket->entries);
+        bucket->entries = (frame_info_t*)cur;
+        cur += align_to_8(bucket->sizeOfEntries);
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    
+    // the frames moved, so the ID index is rebuilt rather than copied.
+    free(table->ids);
+    table->ids = (id_entry_t*)cur;
+    fill_id_index(table, table->ids);
+    cur += table->numIds * sizeof(id_entry_t);
+    
+    // tables built with insert_key have NULL arrays.
+    if(table->numStaticRoots > 0) {
+        memcpy(cur, table->staticRoots, table->numStaticRoots * sizeof(uint64_t));
+    }
+    free(table->staticRoots);
+    table->staticRoots = (uint64_t*)cur;
+    cur += table->numStaticRoots * sizeof(uint64_t);
+    
+    if(table->numFunctions > 0) {
+        memcpy(cur, table->functions, table->numFunctions * sizeof(function_entry_t));
+    }
+    free(table->functions);
+    table->functions = (function_entry_t*)cur;
+    cur += table->numFunctions * sizeof(function_entry_t);
+    
+    patchpoint_info_t** patchpoints = (patchpoint_info_t**)cur;
+    cur += table->numPatchpoints * sizeof(patchpoint_info_t*);
+    for(uint64_t i = 0; i < table->numPatchpoints; i++) {
+        size_t size = size_of_patchpoint(table->patchpoints[i]->numValues);
+        memcpy(cur, table->patchpoints[i], size);
+        free(table->patchpoints[i]);
+        patchpoints[i] = (patchpoint_info_t*)cur;
+        cur += align_to_8(size);
+    }
+    free(table->patchpoints);
+    table->patchpoints = patchpoints;
+}
+
+bool seal_table(statepoint_table_t* table) {
+    if(table->region != NULL) {
+        return true;
+    }
+    
+    // a shared mapping is inherited as is by forked children, and being read-only,
+    // its pages are never copied.
+    size_t size = sealed_size(table);
+    size_t mapSize = size > 0 ? size : sizeof(uint64_t);
+    void* region = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, 
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED) {
+        return false;
+    }
+    
+    move_into_region(table, (uint8_t*)region);
+    table->region = region;
+    table->regionSize = mapSize;
+    
+    if(mprotect(region, mapSize, PROT_READ) != 0) {
+        fprintf(stderr, "(statepoint-utils) warning: \
+                         \n\tcouldn't make the sealed table read-only!\n");
+    }
+    return true;
+}
+
+void unmap_region(void* region, size_t size) {
+    munmap(region, size);
+}
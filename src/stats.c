@@ -0,0 +1,142 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "include/api.h"
+#include "include/hash_table.h"
+
+#include <pthread.h>
+#include <time.h>
+
+/*
+   Each thread counts and traces into its own block, which it registers on its first
+   count or event. Blocks are linked together so statepoint_stats can add them up,
+   and a thread's counts are moved into the retired totals when it exits.
+*/
+
+// defined whether or not the library counts, so that callers can.
+__thread statepoint_stats_t* statepointThreadStats = NULL;
+static __thread thread_block_t* threadBlock = NULL;
+
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static thread_block_t* statsBlocks = NULL;
+static uint64_t numRegistered = 0;
+static statepoint_stats_t retiredStats;
+
+static pthread_once_t statsKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t statsKey;
+
+// reads the counters of a thread, which may be counting concurrently.
+void load_stats(statepoint_stats_t* stats, statepoint_stats_t* out) {
+    out->lookups = __atomic_load_n(&stats->lookups, __ATOMIC_RELAXED);
+    out->lookupHits = __atomic_load_n(&stats->lookupHits, __ATOMIC_RELAXED);
+    out->lookupMisses = __atomic_load_n(&stats->lookupMisses, __ATOMIC_RELAXED);
+    out->entriesProbed = __atomic_load_n(&stats->entriesProbed, __ATOMIC_RELAXED);
+    out->framesScanned = __atomic_load_n(&stats->framesScanned, __ATOMIC_RELAXED);
+    out->rootsVisited = __atomic_load_n(&stats->rootsVisited, __ATOMIC_RELAXED);
+    out->stacksWalked = __atomic_load_n(&stats->stacksWalked, __ATOMIC_RELAXED);
+    out->walkNanos = __atomic_load_n(&stats->walkNanos, __ATOMIC_RELAXED);
+    out->maxWalkNanos = __atomic_load_n(&stats->maxWalkNanos, __ATOMIC_RELAXED);
+}
+
+void add_stats(statepoint_stats_t* total, statepoint_stats_t* stats) {
+    total->lookups += stats->lookups;
+    total->lookupHits += stats->lookupHits;
+    total->lookupMisses += stats->lookupMisses;
+    total->entriesProbed += stats->entriesProbed;
+    total->framesScanned += stats->framesScanned;
+    total->rootsVisited += stats->rootsVisited;
+    total->stacksWalked += stats->stacksWalked;
+    total->walkNanos += stats->walkNanos;
+    if(stats->maxWalkNanos > total->maxWalkNanos) {
+        total->maxWalkNanos = stats->maxWalkNanos;
+    }
+}
+
+void retire_thread(void* arg) {
+    thread_block_t* block = (thread_block_t*)arg;
+    statepointThreadStats = NULL;
+    threadBlock = NULL;
+
+    pthread_mutex_lock(&statsLock);
+    add_stats(&retiredStats, &block->stats);
+    thread_block_t** link = &statsBlocks;
+    while(*link != block) {
+        link = &(*link)->next;
+    }
+    *link = block->next;
+    pthread_mutex_unlock(&statsLock);
+
+    if(block->trace != NULL) {
+        free_trace_ring(block->trace);
+    }
+    free(block);
+}
+
+void create_stats_key(void) {
+    pthread_key_create(&statsKey, retire_thread);
+}
+
+thread_block_t* current_thread_block(void) {
+    if(threadBlock != NULL) {
+        return threadBlock;
+    }
+
+    thread_block_t* block = calloc(1, sizeof(thread_block_t));
+    assert(block && "bad alloc");
+
+    pthread_once(&statsKeyOnce, create_stats_key);
+    pthread_setspecific(statsKey, block);
+
+    pthread_mutex_lock(&statsLock);
+    block->threadId = ++numRegistered;
+    block->next = statsBlocks;
+    statsBlocks = block;
+    pthread_mutex_unlock(&statsLock);
+
+    threadBlock = block;
+    statepointThreadStats = &block->stats;
+    return block;
+}
+
+void for_each_thread_block(void (*fn)(thread_block_t* block, void* arg), void* arg) {
+    pthread_mutex_lock(&statsLock);
+    for(thread_block_t* block = statsBlocks; block != NULL; block = block->next) {
+        fn(block, arg);
+    }
+    pthread_mutex_unlock(&statsLock);
+}
+
+statepoint_stats_t* statepoint_register_thread(void) {
+    return &current_thread_block()->stats;
+}
+
+uint64_t statepoint_stats(statepoint_stats_t* total) {
+    pthread_mutex_lock(&statsLock);
+    *total = retiredStats;
+
+    uint64_t numThreads = 0;
+    for(thread_block_t* block = statsBlocks; block != NULL; block = block->next) {
+        statepoint_stats_t stats;
+        load_stats(&block->stats, &stats);
+        add_stats(total, &stats);
+        numThreads++;
+    }
+    pthread_mutex_unlock(&statsLock);
+
+    return numThreads;
+}
+
+void statepoint_thread_stats(statepoint_stats_t* stats) {
+    if(statepointThreadStats == NULL) {
+        memset(stats, 0, sizeof(statepoint_stats_t));
+        return;
+    }
+    load_stats(statepointThreadStats, stats);
+}
+
+uint64_t statepoint_stats_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
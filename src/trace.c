@@ -0,0 +1,130 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "include/api.h"
+#include "include/hash_table.h"
+
+#include <unistd.h>
+
+/*
+   Each thread records its events into a ring buffer of its own, without locks: only
+   the thread itself writes to it, and it publishes each event by advancing head.
+   statepoint_trace_dump copies a ring and then checks which of the copied events the
+   thread may have overwritten meanwhile, dropping those. As in a seqlock, a fence
+   orders each advance of head before the writes of the next event, and another orders
+   the dumper's copy before its second look at head, so a copy that saw any write of a
+   later event also sees that event's head.
+*/
+
+#define TRACE_RING_SIZE 4096    // a power of two
+
+typedef struct {
+    uint64_t start;     // in nanoseconds, see statepoint_stats_clock
+    uint64_t end;
+    uint64_t arg;
+    uint64_t kind;
+} trace_event_t;
+
+struct trace_ring {
+    uint64_t head;      // the number of events ever recorded
+    trace_event_t events[TRACE_RING_SIZE];
+};
+
+void free_trace_ring(trace_ring_t* ring) {
+    free(ring);
+}
+
+void statepoint_trace_event(uint32_t kind, uint64_t start, uint64_t end, uint64_t arg) {
+    thread_block_t* block = current_thread_block();
+    trace_ring_t* ring = block->trace;
+    if(ring == NULL) {
+        ring = calloc(1, sizeof(trace_ring_t));
+        assert(ring && "bad alloc");
+        __atomic_store_n(&block->trace, ring, __ATOMIC_RELEASE);
+    }
+
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    trace_event_t* event = ring->events + (head & (TRACE_RING_SIZE - 1));
+    
+    // pairs with the acquire fence in dump_thread_events.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&event->start, start, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->end, end, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->arg, arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->kind, (uint64_t)kind, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+typedef struct {
+    FILE* stream;
+    trace_event_t* events;  // a copy of the ring being dumped
+    bool first;
+    long pid;
+} dump_state_t;
+
+void print_trace_event(dump_state_t* state, trace_event_t* event, uint64_t threadId) {
+    const char* name = event->kind == TRACE_WALK_STACK ? "walk_stack" : "scan_frame";
+    const char* argName = event->kind == TRACE_WALK_STACK ? "frames" : "slots";
+    uint64_t duration = event->end - event->start;
+
+    // the timestamps are in microseconds
+    fprintf(state->stream, "%s\n{\"name\": \"%s\", \"cat\": \"statepoint\", \"ph\": \"X\", "
+                           "\"ts\": %" PRIu64 ".%03" PRIu64 ", \"dur\": %" PRIu64 ".%03" PRIu64
+                           ", \"pid\": %ld, \"tid\": %" PRIu64 ", "
+                           "\"args\": {\"%s\": %" PRIu64 "}}",
+            state->first ? "" : ",", name,
+            event->start / 1000, event->start % 1000, duration / 1000, duration % 1000,
+            state->pid, threadId, argName, event->arg);
+    state->first = false;
+}
+
+void dump_thread_events(thread_block_t* block, void* arg) {
+    dump_state_t* state = (dump_state_t*)arg;
+    trace_ring_t* ring = __atomic_load_n(&block->trace, __ATOMIC_ACQUIRE);
+    if(ring == NULL) {
+        return;
+    }
+
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for(uint64_t i = first; i < head; i++) {
+        trace_event_t* event = ring->events + (i & (TRACE_RING_SIZE - 1));
+        trace_event_t* copy = state->events + (i & (TRACE_RING_SIZE - 1));
+        copy->start = __atomic_load_n(&event->start, __ATOMIC_RELAXED);
+        copy->end = __atomic_load_n(&event->end, __ATOMIC_RELAXED);
+        copy->arg = __atomic_load_n(&event->arg, __ATOMIC_RELAXED);
+        copy->kind = __atomic_load_n(&event->kind, __ATOMIC_RELAXED);
+    }
+
+    // the thread is writing event number newHead, and may have written over any
+    // event after the one it replaces. pairs with the release fence in
+    // statepoint_trace_event.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t newHead = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    if(newHead + 1 > first + TRACE_RING_SIZE) {
+        first = newHead + 1 - TRACE_RING_SIZE;
+    }
+
+    for(uint64_t i = first; i < head; i++) {
+        print_trace_event(state, state->events + (i & (TRACE_RING_SIZE - 1)),
+                          block->threadId);
+    }
+}
+
+bool statepoint_trace_dump(FILE* stream) {
+    dump_state_t state;
+    state.stream = stream;
+    state.events = malloc(TRACE_RING_SIZE * sizeof(trace_event_t));
+    assert(state.events && "bad alloc");
+    state.first = true;
+    state.pid = (long)getpid();
+
+    fprintf(stream, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for_each_thread_block(dump_thread_events, &state);
+    fprintf(stream, "\n]}\n");
+
+    free(state.events);
+    fflush(stream);
+    return !ferror(stream);
+}
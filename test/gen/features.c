@@ -0,0 +1,1129 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE     // for mkdtemp and MAP_ANONYMOUS
+#endif
+
+#include "../../dist/llvm-statepoint-tablegen.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// for PRIu and PRId
+#define __STDC_FORMAT_MACROS 1
+#include <inttypes.h>
+
+/*
+   Checks the parts of the library that the generated programs don't exercise, on
+   stack maps written by hand, so that every value the tables should hold is known.
+   Each test builds the stack maps it needs with the functions below, which write the
+   LLVM stack map format (version 3) the way llc does.
+
+   usage: features
+
+   Prints the name of each test as it passes, and exits with 1 at the first failed
+   check.
+*/
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            fprintf(stderr, "features: %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while(0)
+
+// the Dwarf registers of the stack and frame pointers
+#define SP 7
+#define FP 6
+
+// the kinds of locations
+#define REGISTER 1
+#define DIRECT 2
+#define INDIRECT 3
+#define CONSTANT 4
+#define CONST_INDEX 5
+
+typedef struct {
+    uint8_t kind;
+    uint16_t regNum;
+    int32_t offset;
+} location_t;
+
+typedef struct {
+    uint8_t* bytes;     // 8-byte aligned, like the section
+    size_t length;
+    size_t capacity;
+} stackmap_t;
+
+void init_stackmap(stackmap_t* map) {
+    map->bytes = NULL;
+    map->length = 0;
+    map->capacity = 0;
+}
+
+void emit(stackmap_t* map, const void* data, size_t size) {
+    if(map->length + size > map->capacity) {
+        map->capacity = 2 * (map->length + size) + 64;
+        map->bytes = realloc(map->bytes, map->capacity);
+        assert(map->bytes && "bad alloc");
+    }
+    memcpy(map->bytes + map->length, data, size);
+    map->length += size;
+}
+
+void emit_zeros(stackmap_t* map, size_t size) {
+    uint8_t zero = 0;
+    for(size_t i = 0; i < size; i++) {
+        emit(map, &zero, 1);
+    }
+}
+
+void align_stackmap(stackmap_t* map) {
+    emit_zeros(map, (8 - (map->length & 0x7)) & 0x7);
+}
+
+void emit_header(stackmap_t* map, uint32_t numFunctions, uint32_t numConstants,
+                 uint32_t numRecords) {
+    uint8_t version[4] = { 3, 0, 0, 0 };
+    emit(map, version, sizeof(version));
+    emit(map, &numFunctions, sizeof(uint32_t));
+    emit(map, &numConstants, sizeof(uint32_t));
+    emit(map, &numRecords, sizeof(uint32_t));
+}
+
+void emit_function(stackmap_t* map, uint64_t address, uint64_t stackSize,
+                   uint64_t numRecords) {
+    emit(map, &address, sizeof(uint64_t));
+    emit(map, &stackSize, sizeof(uint64_t));
+    emit(map, &numRecords, sizeof(uint64_t));
+}
+
+void emit_constant(stackmap_t* map, uint64_t value) {
+    emit(map, &value, sizeof(uint64_t));
+}
+
+void emit_record(stackmap_t* map, uint64_t id, uint32_t codeOffset,
+                 const location_t* locations, uint16_t numLocations, uint16_t numLiveouts) {
+    uint16_t flags = 0;
+    emit(map, &id, sizeof(uint64_t));
+    emit(map, &codeOffset, sizeof(uint32_t));
+    emit(map, &flags, sizeof(uint16_t));
+    emit(map, &numLocations, sizeof(uint16_t));
+
+    for(uint16_t i = 0; i < numLocations; i++) {
+        uint16_t size = 8;
+        emit(map, &locations[i].kind, sizeof(uint8_t));
+        emit_zeros(map, 1);
+        emit(map, &size, sizeof(uint16_t));
+        emit(map, &locations[i].regNum, sizeof(uint16_t));
+        emit_zeros(map, 2);
+        emit(map, &locations[i].offset, sizeof(int32_t));
+    }
+    align_stackmap(map);
+
+    emit_zeros(map, 2);
+    emit(map, &numLiveouts, sizeof(uint16_t));
+    for(uint16_t i = 0; i < numLiveouts; i++) {
+        uint8_t liveout[4] = { 3, 0, 0, 8 };  // all of register 3
+        emit(map, liveout, sizeof(liveout));
+    }
+    align_stackmap(map);
+}
+
+// A statepoint's record: the three leading constants, the deopt locations, then the
+// locations of the GC roots.
+void emit_statepoint(stackmap_t* map, uint64_t id, uint32_t codeOffset,
+                     const location_t* deopt, uint16_t numDeopt,
+                     const location_t* roots, uint16_t numRoots) {
+    location_t locations[64];
+    assert(3 + numDeopt + numRoots <= 64 && "too many locations");
+
+    location_t constant = { CONSTANT, 0, 0 };
+    locations[0] = constant;
+    locations[1] = constant;
+    locations[2] = constant;
+    locations[2].offset = numDeopt;
+    for(uint16_t i = 0; i < numDeopt; i++) {
+        locations[3 + i] = deopt[i];
+    }
+    for(uint16_t i = 0; i < numRoots; i++) {
+        locations[3 + numDeopt + i] = roots[i];
+    }
+    emit_record(map, id, codeOffset, locations, 3 + numDeopt + numRoots, 0);
+}
+
+statepoint_table_t* generate(stackmap_t* map, table_options_t* options) {
+    return generate_table_with_options(map->bytes, map->length, options);
+}
+
+
+/**** The function index ****/
+
+typedef struct {
+    uint64_t start;
+    uint64_t size;
+    const char* name;
+} symbol_t;
+
+const char* name_from_symbols(uint64_t address, uint64_t* size, void* context) {
+    for(symbol_t* symbol = (symbol_t*)context; symbol->name != NULL; symbol++) {
+        if(symbol->start == address) {
+            *size = symbol->size;
+            return symbol->name;
+        }
+    }
+    return NULL;
+}
+
+// f1 ends in a call, so its last return address is where f2 starts.
+void emit_adjacent_functions(stackmap_t* map) {
+    location_t root = { INDIRECT, SP, 8 };
+    location_t roots[2] = { root, root };
+
+    emit_header(map, 3, 0, 4);
+    emit_function(map, 0x10000, 16, 2);
+    emit_function(map, 0x10040, 32, 1);
+    emit_function(map, 0x20000, 16, 1);
+    emit_statepoint(map, 1, 0x18, NULL, 0, roots, 2);
+    emit_statepoint(map, 2, 0x40, NULL, 0, roots, 2);
+    emit_statepoint(map, 3, 0x10, NULL, 0, roots, 2);
+    emit_statepoint(map, 4, 0x8, NULL, 0, roots, 2);
+}
+
+uint64_t function_start(statepoint_table_t* table, uint64_t address) {
+    function_entry_t* fn = lookup_function(table, address);
+    return fn == NULL ? 0 : fn->start;
+}
+
+void test_function_index(void) {
+    stackmap_t map;
+    init_stackmap(&map);
+    emit_adjacent_functions(&map);
+
+    table_options_t options;
+    default_table_options(&options);
+    statepoint_table_t* table = generate(&map, &options);
+    CHECK(table != NULL);
+    CHECK(table->numFunctions == 3);
+
+    // every return address maps to the function of its record.
+    CHECK(function_start(table, 0x10018) == 0x10000);
+    CHECK(function_start(table, 0x10040) == 0x10000);
+    CHECK(function_start(table, 0x10050) == 0x10040);
+    CHECK(function_start(table, 0x20008) == 0x20000);
+
+    // the rest of f2 is still its own, and it runs up to f3.
+    CHECK(function_start(table, 0x10000) == 0x10000);
+    CHECK(function_start(table, 0x1003F) == 0x10000);
+    CHECK(function_start(table, 0x10041) == 0x10040);
+    CHECK(function_start(table, 0x1FFFF) == 0x10040);
+    CHECK(lookup_function(table, 0xFFFF) == NULL);
+
+    // the last function ends just past its last return address.
+    CHECK(function_start(table, 0x20009) == 0);
+
+    CHECK(lookup_function(table, 0x10050)->numCallsites == 1);
+    CHECK(lookup_function(table, 0x10050)->stackSize == 32);
+    CHECK(function_name(table, lookup_function(table, 0x10050)) == NULL);
+    destroy_table(table);
+
+    // the symbols end right at the return addresses of calls that end them.
+    symbol_t symbols[] = {
+        { 0x10000, 0x40, "f1" },
+        { 0x10040, 0x20, "f2" },
+        { 0x20000, 0x100, "f3" },
+        { 0, 0, NULL }
+    };
+    options.nameFunction = name_from_symbols;
+    options.namerContext = symbols;
+    table = generate(&map, &options);
+    CHECK(table != NULL);
+
+    CHECK(function_start(table, 0x10040) == 0x10000);
+    CHECK(function_start(table, 0x1005F) == 0x10040);
+    CHECK(function_start(table, 0x10060) == 0);
+    CHECK(function_start(table, 0x200FF) == 0x20000);
+    CHECK(function_start(table, 0x20100) == 0);
+    CHECK(strcmp(function_name(table, lookup_function(table, 0x10040)), "f1") == 0);
+    CHECK(strcmp(function_name(table, lookup_function(table, 0x10050)), "f2") == 0);
+    destroy_table(table);
+
+    free(map.bytes);
+}
+
+
+
+/**** Statepoint IDs ****/
+
+void emit_ids(stackmap_t* map) {
+    location_t root = { INDIRECT, SP, 8 };
+    location_t roots[2] = { root, root };
+    
+    emit_header(map, 2, 0, 4);
+    emit_function(map, 0x80000, 16, 2);
+    emit_function(map, 0x90000, 32, 2);
+    emit_statepoint(map, 7, 0x20, NULL, 0, roots, 2);
+    emit_statepoint(map, 5, 0x30, NULL, 0, roots, 2);
+    emit_statepoint(map, 9, 0x10, NULL, 0, roots, 2);
+    emit_statepoint(map, 7, 0x18, NULL, 0, roots, 2);
+}
+
+void test_statepoint_ids(void) {
+    stackmap_t map;
+    init_stackmap(&map);
+    emit_ids(&map);
+    
+    table_options_t options;
+    default_table_options(&options);
+    options.recordIds = true;
+    statepoint_table_t* table = generate(&map, &options);
+    CHECK(table != NULL && table->numIds == 4);
+    
+    // IDs need not be unique, and the frames sharing one are in address order.
+    uint64_t count;
+    id_entry_t* entries = lookup_statepoint_id(table, 7, &count);
+    CHECK(entries != NULL && count == 2);
+    CHECK(entries[0].id == 7 && entries[0].frame->retAddr == 0x80020);
+    CHECK(entries[1].id == 7 && entries[1].frame->retAddr == 0x90018);
+    CHECK(entries[1].frame->frameSize == 32);
+    
+    entries = lookup_statepoint_id(table, 9, &count);
+    CHECK(entries != NULL && count == 1 && entries[0].frame->retAddr == 0x90010);
+    CHECK(lookup_statepoint_id(table, 6, &count) == NULL && count == 0);
+    CHECK(lookup_statepoint_id(table, 10, &count) == NULL && count == 0);
+    
+    // and each frame has its own.
+    CHECK(*frame_statepoint_id(lookup_return_address(table, 0x80030)) == 5);
+    CHECK(*frame_statepoint_id(lookup_return_address(table, 0x90018)) == 7);
+    CHECK(lookup_return_address(table, 0x80030)->numSlots == 1);
+    destroy_table(table);
+    
+    options.recordIds = false;
+    table = generate(&map, &options);
+    CHECK(table != NULL && table->numIds == 0);
+    CHECK(frame_statepoint_id(lookup_return_address(table, 0x80030)) == NULL);
+    CHECK(lookup_statepoint_id(table, 7, &count) == NULL && count == 0);
+    destroy_table(table);
+    
+    free(map.bytes);
+}
+
+
+/**** User data ****/
+
+// calls check with each frame of the table.
+void for_each_frame(statepoint_table_t* table, void (*check)(frame_info_t* frame)) {
+    for(uint64_t i = 0; i < table->size; i++) {
+        frame_info_t* frame = table->buckets[i].entries;
+        for(uint64_t k = 0; k < table->buckets[i].numEntries; k++) {
+            check(frame);
+            frame = (frame_info_t*)((uint8_t*)frame + statepoint_frame_size(frame));
+        }
+    }
+}
+
+// 12 bytes are rounded up to two words, zeroed, at the end of the frame.
+void check_user_data(frame_info_t* frame) {
+    uint8_t* data = frame_user_data(frame);
+    CHECK(data != NULL && ((uintptr_t)data & 0x7) == 0);
+    CHECK((frame->flags >> FRAME_USER_DATA_SHIFT) == 2);
+    CHECK(data + 16 == (uint8_t*)frame + statepoint_frame_size(frame));
+    for(int i = 0; i < 16; i++) {
+        CHECK(data[i] == 0);
+    }
+}
+
+// the ID comes first.
+void check_user_data_after_id(frame_info_t* frame) {
+    check_user_data(frame);
+    uint64_t* id = frame_statepoint_id(frame);
+    CHECK(id != NULL && (uint8_t*)(id + 1) == frame_user_data(frame));
+}
+
+void fill_user_data(frame_info_t* frame) {
+    uint64_t* data = frame_user_data(frame);
+    data[0] = frame->retAddr;
+    data[1] = ~frame->retAddr;
+}
+
+void check_filled_user_data(frame_info_t* frame) {
+    uint64_t* data = frame_user_data(frame);
+    CHECK(data[0] == frame->retAddr && data[1] == ~frame->retAddr);
+}
+
+void test_user_data(void) {
+    stackmap_t map;
+    init_stackmap(&map);
+    emit_ids(&map);
+    
+    table_options_t options;
+    default_table_options(&options);
+    options.userDataSize = 12;
+    statepoint_table_t* table = generate(&map, &options);
+    CHECK(table != NULL);
+    for_each_frame(table, check_user_data);
+    frame_info_t* frame = lookup_return_address(table, 0x90018);
+    CHECK(frame != NULL && frame->numSlots == 1 && frame->frameSize == 32);
+    CHECK(frame_statepoint_id(frame) == NULL);
+    destroy_table(table);
+    
+    options.recordIds = true;
+    table = generate(&map, &options);
+    CHECK(table != NULL);
+    for_each_frame(table, check_user_data_after_id);
+    CHECK(*frame_statepoint_id(lookup_return_address(table, 0x80030)) == 5);
+    uint64_t count;
+    CHECK(lookup_statepoint_id(table, 7, &count) != NULL && count == 2);
+    
+    // what the collector keeps there before sealing is sealed with the frame.
+    for_each_frame(table, fill_user_data);
+    CHECK(seal_table(table));
+    for_each_frame(table, check_filled_user_data);
+    destroy_table(table);
+    
+    options.userDataSize = 0;
+    table = generate(&map, &options);
+    CHECK(table != NULL);
+    frame = lookup_return_address(table, 0x80020);
+    CHECK(frame_user_data(frame) == NULL && (frame->flags >> FRAME_USER_DATA_SHIFT) == 0);
+    CHECK(*frame_statepoint_id(frame) == 7);
+    destroy_table(table);
+    
+    free(map.bytes);
+}
+
+/**** Deopt state ****/
+
+void check_value(value_info_t* value, uint16_t kind, uint16_t regNum, int64_t v) {
+    CHECK(value->kind == kind && value->size == 8);
+    CHECK(kind == VALUE_CONSTANT || kind == VALUE_UNKNOWN || value->regNum == regNum);
+    CHECK(value->value == v);
+}
+
+void test_deopt_state(void) {
+    location_t root = { INDIRECT, SP, 8 };
+    location_t roots[2] = { root, root };
+    location_t deopt[10] = {
+        { REGISTER, 3, 0 },
+        { DIRECT, SP, 16 },
+        { INDIRECT, SP, 24 },
+        { INDIRECT, FP, -8 },
+        { CONSTANT, 0, 7 },
+        { CONST_INDEX, 0, 1 },
+        { DIRECT, 3, 12 },      // relative to registers other than SP and FP
+        { INDIRECT, 12, -16 },
+        { 9, 0, 0 },            // of a kind we don't know
+        { CONST_INDEX, 0, 5 }   // out of the constant pool
+    };
+    
+    stackmap_t map;
+    init_stackmap(&map);
+    emit_header(&map, 1, 2, 2);
+    emit_function(&map, 0x60000, 48, 2);
+    emit_constant(&map, 0x11);
+    emit_constant(&map, 0xFEEDFACE);
+    emit_statepoint(&map, 1, 0x10, deopt, 10, roots, 2);
+    emit_statepoint(&map, 2, 0x20, NULL, 0, roots, 2);
+    
+    table_options_t options;
+    default_table_options(&options);
+    statepoint_table_t* table = generate(&map, &options);
+    CHECK(table != NULL);
+    
+    deopt_info_t* state = lookup_deopt_state(table, 0x60010);
+    CHECK(state != NULL && state->retAddr == 0x60010 && state->numValues == 10);
+    check_value(state->values + 0, VALUE_IN_REGISTER, 3, 0);
+    check_value(state->values + 1, VALUE_FRAME_ADDRESS, SP, 16);
+    check_value(state->values + 2, VALUE_IN_FRAME, SP, 24);
+    check_value(state->values + 3, VALUE_IN_FRAME, FP, 48 - 8);
+    check_value(state->values + 4, VALUE_CONSTANT, 0, 7);
+    check_value(state->values + 5, VALUE_CONSTANT, 0, 0xFEEDFACE);
+    check_value(state->values + 6, VALUE_REGISTER_ADDRESS, 3, 12);
+    check_value(state->values + 7, VALUE_IN_MEMORY, 12, -16);
+    check_value(state->values + 8, VALUE_UNKNOWN, 0, 0);
+    check_value(state->values + 9, VALUE_UNKNOWN, 0, 0);
+    
+    // the deopt locations aren't roots.
+    frame_info_t* frame = lookup_return_address(table, 0x60010);
+    CHECK(frame != NULL && frame->numSlots == 1 && frame->slots[0].offset == 8);
+    
+    CHECK(lookup_deopt_state(table, 0x60020) == NULL);
+    CHECK(lookup_deopt_state(table, 0x60030) == NULL);
+    destroy_table(table);
+    
+    free(map.bytes);
+}
+
+
+/**** Roots that can't be described ****/
+
+// a stack map whose second statepoint has the given roots.
+void emit_with_roots(stackmap_t* map, const location_t* roots, uint16_t numRoots) {
+    location_t root = { INDIRECT, SP, 8 };
+    location_t good[2] = { root, root };
+    
+    init_stackmap(map);
+    emit_header(map, 1, 0, 2);
+    emit_function(map, 0x70000, 16, 2);
+    emit_statepoint(map, 1, 0x10, NULL, 0, good, 2);
+    emit_statepoint(map, 2, 0x20, NULL, 0, roots, numRoots);
+}
+
+void test_unusable_roots(void) {
+    location_t root = { INDIRECT, SP, 8 };
+    location_t unpaired[3] = { root, root, root };
+    location_t otherRegister[2] = { { INDIRECT, 3, 8 }, { INDIRECT, 3, 8 } };
+    location_t otherDerived[2] = { root, { INDIRECT, 3, 16 } };
+    location_t otherAlloca[1] = { { DIRECT, 3, 8 } };
+    
+    // a walk would stop at such a frame, so no table is made rather than a partial one,
+    // and the host process carries on.
+    table_options_t options;
+    default_table_options(&options);
+    stackmap_t map;
+    
+    emit_with_roots(&map, unpaired, 3);
+    CHECK(generate(&map, &options) == NULL);
+    free(map.bytes);
+    
+    emit_with_roots(&map, otherRegister, 2);
+    CHECK(generate(&map, &options) == NULL);
+    free(map.bytes);
+    
+    emit_with_roots(&map, otherDerived, 2);
+    CHECK(generate(&map, &options) == NULL);
+    free(map.bytes);
+    
+    emit_with_roots(&map, otherAlloca, 1);
+    table_build_t* build = start_table_build(map.bytes, map.length, &options);
+    CHECK(await_table(build) == NULL);
+    destroy_table_build(build);
+    free(map.bytes);
+    
+    // while a root the library skips, e.g. in a register, doesn't fail the table.
+    location_t inRegister[2] = { { REGISTER, 3, 0 }, { REGISTER, 3, 0 } };
+    emit_with_roots(&map, inRegister, 2);
+    statepoint_table_t* table = generate(&map, &options);
+    CHECK(table != NULL);
+    CHECK(lookup_return_address(table, 0x70020)->numSlots == 0);
+    destroy_table(table);
+    free(map.bytes);
+}
+
+
+/**** Static roots ****/
+
+void test_static_roots(void) {
+    location_t root = { INDIRECT, SP, 8 };
+    location_t small = { CONSTANT, 0, 0x1000 };
+    location_t pooled = { CONST_INDEX, 0, 1 };
+    location_t null = { CONSTANT, 0, 0 };
+    location_t outOfRange = { CONST_INDEX, 0, 2 };
+    location_t first[8] = { root, root, small, small, pooled, pooled, null, null };
+    location_t second[6] = { small, small, outOfRange, outOfRange, root, root };
+    
+    // constant roots are gathered from both stack maps of the section.
+    stackmap_t map;
+    init_stackmap(&map);
+    emit_header(&map, 1, 2, 1);
+    emit_function(&map, 0x40000, 16, 1);
+    emit_constant(&map, 0x123456789);
+    emit_constant(&map, 0x42);
+    emit_statepoint(&map, 1, 0x10, NULL, 0, first, 8);
+    emit_zeros(&map, 8);
+    emit_header(&map, 1, 1, 1);
+    emit_function(&map, 0x50000, 16, 1);
+    emit_constant(&map, 0x7);
+    emit_statepoint(&map, 2, 0x10, NULL, 0, second, 6);
+    
+    table_options_t options;
+    default_table_options(&options);
+    statepoint_table_t* table = generate(&map, &options);
+    CHECK(table != NULL);
+    
+    // sorted and distinct, without null, and without the constant out of its pool.
+    CHECK(table->numStaticRoots == 2);
+    CHECK(table->staticRoots[0] == 0x42);
+    CHECK(table->staticRoots[1] == 0x1000);
+    
+    // the frames only hold the roots in the frame.
+    frame_info_t* frame = lookup_return_address(table, 0x40010);
+    CHECK(frame != NULL && frame->numSlots == 1 && frame->slots[0].offset == 8);
+    frame = lookup_return_address(table, 0x50010);
+    CHECK(frame != NULL && frame->numSlots == 1 && frame->slots[0].offset == 8);
+    destroy_table(table);
+    
+    free(map.bytes);
+}
+
+
+/**** Telling statepoints and patchpoints apart ****/
+
+#define TAG 0xABCD0000
+
+// one record of each kind in one function, at the given code offsets.
+void emit_mixed_records(stackmap_t* map) {
+    location_t root = { INDIRECT, SP, 8 };
+    location_t roots[2] = { root, root };
+    location_t patchpoint[3] = { { REGISTER, 3, 0 }, { INDIRECT, SP, 16 }, { CONSTANT, 0, 42 } };
+    location_t constant = { CONSTANT, 0, 0 };
+    location_t tooManyDeopt[4] = { constant, constant, constant, root };
+    tooManyDeopt[2].offset = 2;
+    
+    emit_header(map, 1, 0, 6);
+    emit_function(map, 0x30000, 32, 6);
+    emit_statepoint(map, TAG | 1, 0x10, NULL, 0, roots, 2);
+    
+    // a patchpoint with liveouts, and a stackmap intrinsic without locations
+    emit_record(map, 2, 0x20, patchpoint, 3, 1);
+    emit_record(map, 3, 0x30, NULL, 0, 0);
+    
+    // a statepoint without the tag
+    emit_statepoint(map, 4, 0x40, NULL, 0, roots, 2);
+    
+    // records with the tag but without the shape of a statepoint: one whose third
+    // location counts more deopt locations than there are, and the patchpoint.
+    emit_record(map, TAG | 5, 0x50, tooManyDeopt, 4, 0);
+    emit_record(map, TAG | 6, 0x60, patchpoint, 3, 0);
+}
+
+void test_patchpoints(void) {
+    stackmap_t map;
+    init_stackmap(&map);
+    emit_mixed_records(&map);
+    
+    // without the ID convention, records are told apart by their shape alone.
+    table_options_t options;
+    default_table_options(&options);
+    options.indexPatchpoints = true;
+    statepoint_table_t* table = generate(&map, &options);
+    CHECK(table != NULL);
+    CHECK(lookup_return_address(table, 0x30010) != NULL);
+    CHECK(lookup_return_address(table, 0x30040) != NULL);
+    CHECK(table->numPatchpoints == 4);
+    for(uint64_t address = 0x30020; address <= 0x30060; address += 0x10) {
+        bool statepoint = address == 0x30040;
+        CHECK((lookup_return_address(table, address) != NULL) == statepoint);
+        CHECK((lookup_patchpoint(table, address) != NULL) == !statepoint);
+    }
+    CHECK(lookup_patchpoint(table, 0x30021) == NULL);
+    
+    patchpoint_info_t* patchpoint = lookup_patchpoint(table, 0x30020);
+    CHECK(patchpoint->id == 2 && patchpoint->frameSize == 32 && patchpoint->numValues == 3);
+    CHECK(patchpoint->values[0].kind == VALUE_IN_REGISTER && patchpoint->values[0].regNum == 3);
+    CHECK(patchpoint->values[1].kind == VALUE_IN_FRAME && patchpoint->values[1].value == 16);
+    CHECK(patchpoint->values[2].kind == VALUE_CONSTANT && patchpoint->values[2].value == 42);
+    CHECK(lookup_patchpoint(table, 0x30030)->numValues == 0);
+    CHECK(lookup_patchpoint(table, 0x30060)->id == (TAG | 6));
+    destroy_table(table);
+    
+    // with it, the untagged statepoint is a patchpoint too, and the tagged records
+    // must still have the shape of a statepoint.
+    options.statepointIdMask = 0xFFFF0000;
+    options.statepointIdValue = TAG;
+    table = generate(&map, &options);
+    CHECK(table != NULL);
+    CHECK(table->numPatchpoints == 5);
+    CHECK(lookup_return_address(table, 0x30010) != NULL);
+    for(uint64_t address = 0x30020; address <= 0x30060; address += 0x10) {
+        CHECK(lookup_return_address(table, address) == NULL);
+        CHECK(lookup_patchpoint(table, address) != NULL);
+    }
+    CHECK(lookup_deopt_state(table, 0x30050) == NULL);
+    destroy_table(table);
+    
+    // and they are skipped unless indexed.
+    options.indexPatchpoints = false;
+    table = generate(&map, &options);
+    CHECK(table != NULL && table->numPatchpoints == 0);
+    CHECK(lookup_patchpoint(table, 0x30020) == NULL);
+    destroy_table(table);
+    
+    free(map.bytes);
+}
+
+
+/**** Sealed tables ****/
+
+bool in_region(statepoint_table_t* table, const void* p) {
+    const uint8_t* start = (const uint8_t*)table->region;
+    return (const uint8_t*)p >= start && (const uint8_t*)p < start + table->regionSize;
+}
+
+// a stack map of every kind of record, and one with a static root.
+void emit_everything(stackmap_t* map) {
+    location_t root = { INDIRECT, SP, 8 };
+    location_t constant = { CONSTANT, 0, 0x2000 };
+    location_t roots[4] = { root, root, constant, constant };
+    location_t deopt = { CONSTANT, 0, 5 };
+    
+    emit_mixed_records(map);
+    emit_zeros(map, 8);
+    emit_ids(map);
+    emit_zeros(map, 8);
+    emit_header(map, 1, 0, 1);
+    emit_function(map, 0xA0000, 16, 1);
+    emit_statepoint(map, 11, 0x10, &deopt, 1, roots, 4);
+}
+
+// the sealed table has the same contents as the one in the heap, all in its region.
+void check_sealed(statepoint_table_t* sealed, statepoint_table_t* heap) {
+    CHECK(sealed->region != NULL);
+    CHECK(sealed->size == heap->size && in_region(sealed, sealed->buckets));
+    for(uint64_t i = 0; i < heap->size; i++) {
+        table_bucket_t* bucket = heap->buckets + i;
+        CHECK(sealed->buckets[i].numEntries == bucket->numEntries);
+        CHECK(sealed->buckets[i].sizeOfEntries == bucket->sizeOfEntries);
+        
+        frame_info_t* frame = bucket->entries;
+        for(uint64_t k = 0; k < bucket->numEntries; k++) {
+            frame_info_t* found = lookup_return_address(sealed, frame->retAddr);
+            CHECK(found != NULL && in_region(sealed, found));
+            CHECK(memcmp(found, frame, statepoint_frame_size(frame)) == 0);
+            frame = (frame_info_t*)((uint8_t*)frame + statepoint_frame_size(frame));
+        }
+    }
+    
+    CHECK(sealed->numIds == heap->numIds);
+    for(uint64_t i = 0; i < heap->numIds; i++) {
+        CHECK(in_region(sealed, sealed->ids[i].frame));
+        CHECK(sealed->ids[i].id == heap->ids[i].id);
+        CHECK(sealed->ids[i].frame->retAddr == heap->ids[i].frame->retAddr);
+    }
+    uint64_t count;
+    id_entry_t* entries = lookup_statepoint_id(sealed, 7, &count);
+    CHECK(entries != NULL && count == 2 && in_region(sealed, entries));
+    
+    CHECK(sealed->numStaticRoots == 1 && sealed->staticRoots[0] == 0x2000);
+    CHECK(in_region(sealed, sealed->staticRoots));
+    
+    CHECK(sealed->numPatchpoints == heap->numPatchpoints && sealed->numPatchpoints == 4);
+    for(uint64_t i = 0; i < heap->numPatchpoints; i++) {
+        patchpoint_info_t* patchpoint = sealed->patchpoints[i];
+        CHECK(in_region(sealed, patchpoint));
+        CHECK(lookup_patchpoint(sealed, patchpoint->address) == patchpoint);
+        patchpoint_info_t* expected = heap->patchpoints[i];
+        CHECK(patchpoint->address == expected->address && patchpoint->id == expected->id);
+        CHECK(patchpoint->frameSize == expected->frameSize);
+        CHECK(patchpoint->numValues == expected->numValues);
+        for(uint32_t k = 0; k < patchpoint->numValues; k++) {
+            CHECK(patchpoint->values[k].kind == expected->values[k].kind);
+            CHECK(patchpoint->values[k].regNum == expected->values[k].regNum);
+            CHECK(patchpoint->values[k].value == expected->values[k].value);
+        }
+    }
+    
+    CHECK(sealed->numFunctions == heap->numFunctions && sealed->numFunctions == 4);
+    CHECK(in_region(sealed, sealed->functions));
+    CHECK(memcmp(sealed->functions, heap->functions,
+                 heap->numFunctions * sizeof(function_entry_t)) == 0);
+    CHECK(function_start(sealed, 0x90018) == 0x90000);
+    
+    // the deopt index is built from the section, outside the region.
+    deopt_info_t* info = lookup_deopt_state(sealed, 0xA0010);
+    CHECK(info != NULL && !in_region(sealed, info));
+    CHECK(info->numValues == 1 && info->values[0].value == 5);
+}
+
+void test_sealed_tables(void) {
+    stackmap_t map;
+    init_stackmap(&map);
+    emit_everything(&map);
+    
+    table_options_t options;
+    default_table_options(&options);
+    options.recordIds = true;
+    options.indexPatchpoints = true;
+    statepoint_table_t* heap = generate(&map, &options);
+    CHECK(heap != NULL && heap->region == NULL);
+    
+    options.sealed = true;
+    statepoint_table_t* sealed = generate(&map, &options);
+    check_sealed(sealed, heap);
+    
+    // its region can't be written to.
+    pid_t child = fork();
+    CHECK(child >= 0);
+    if(child == 0) {
+        sealed->buckets[0].numEntries = 0;
+        _exit(0);
+    }
+    int status;
+    CHECK(waitpid(child, &status, 0) == child && WIFSIGNALED(status));
+    destroy_table(sealed);
+    
+    // sealing a table after the fact moves it the same way, once.
+    options.sealed = false;
+    sealed = generate(&map, &options);
+    CHECK(seal_table(sealed));
+    check_sealed(sealed, heap);
+    void* region = sealed->region;
+    CHECK(seal_table(sealed) && sealed->region == region);
+    destroy_table(sealed);
+    destroy_table(heap);
+    
+    // a section of nothing but padding seals into an empty table.
+    uint8_t padding[16] = { 0 };
+    options.sealed = true;
+    sealed = generate_table_with_options(padding, sizeof(padding), &options);
+    CHECK(sealed != NULL && sealed->region != NULL);
+    CHECK(sealed->numStaticRoots == 0 && sealed->numFunctions == 0);
+    CHECK(sealed->numIds == 0 && sealed->numPatchpoints == 0);
+    CHECK(lookup_return_address(sealed, 0x10000) == NULL);
+    CHECK(lookup_function(sealed, 0x10000) == NULL);
+    destroy_table(sealed);
+    
+    free(map.bytes);
+}
+
+/**** The table cache ****/
+
+// Counts the tables in the directory, and copies the path of the last one found.
+int find_cached_tables(const char* dir, char* path, size_t size) {
+    DIR* entries = opendir(dir);
+    CHECK(entries != NULL);
+    
+    int numTables = 0;
+    struct dirent* entry;
+    while((entry = readdir(entries)) != NULL) {
+        const char* suffix = strrchr(entry->d_name, '.');
+        if(suffix != NULL && strcmp(suffix, ".table") == 0) {
+            snprintf(path, size, "%s/%s", dir, entry->d_name);
+            numTables++;
+        }
+    }
+    closedir(entries);
+    return numTables;
+}
+
+ino_t inode_of(const char* path) {
+    struct stat info;
+    CHECK(stat(path, &info) == 0);
+    return info.st_ino;
+}
+
+// Reads the whole file into a malloc'd buffer.
+uint8_t* read_file(const char* path, size_t* size) {
+    FILE* in = fopen(path, "rb");
+    CHECK(in != NULL);
+    CHECK(fseek(in, 0, SEEK_END) == 0);
+    long length = ftell(in);
+    CHECK(length >= 0 && fseek(in, 0, SEEK_SET) == 0);
+    
+    uint8_t* bytes = malloc(length + 1);
+    assert(bytes && "bad alloc");
+    CHECK(fread(bytes, 1, length, in) == (size_t)length);
+    fclose(in);
+    *size = length;
+    return bytes;
+}
+
+void write_file(const char* path, uint8_t* bytes, size_t size) {
+    FILE* out = fopen(path, "wb");
+    CHECK(out != NULL);
+    CHECK(fwrite(bytes, 1, size, out) == size);
+    CHECK(fclose(out) == 0);
+}
+
+// the frame with the given return address in a file holding a copy of the table.
+frame_info_t* find_frame_in_file(uint8_t* bytes, size_t size, uint64_t retAddr) {
+    for(size_t i = 0; i + sizeof(frame_info_t) <= size; i += 8) {
+        if(memcmp(bytes + i, &retAddr, sizeof(uint64_t)) == 0) {
+            return (frame_info_t*)(bytes + i);
+        }
+    }
+    return NULL;
+}
+
+// checks a table generated from emit_adjacent_functions.
+void check_adjacent_table(statepoint_table_t* table) {
+    CHECK(table != NULL && table->region != NULL);
+    frame_info_t* frame = lookup_return_address(table, 0x10040);
+    CHECK(frame != NULL && frame->frameSize == 16 && frame->numSlots == 1);
+    CHECK(frame->slots[0].kind < 0 && frame->slots[0].offset == 8);
+    CHECK(lookup_return_address(table, 0x20008) != NULL);
+    CHECK(lookup_return_address(table, 0x20009) == NULL);
+    CHECK(function_start(table, 0x10040) == 0x10000);
+}
+
+void test_cache(void) {
+    char dir[] = "/tmp/statepoint-features-XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    char path[512];
+    
+    stackmap_t map;
+    init_stackmap(&map);
+    emit_adjacent_functions(&map);
+    
+    table_options_t options;
+    default_table_options(&options);
+    options.cacheDir = dir;
+    
+    // the first run writes the table, which the next ones map, even while the first
+    // one is still mapped where the table was written from.
+    statepoint_table_t* first = generate(&map, &options);
+    check_adjacent_table(first);
+    CHECK(find_cached_tables(dir, path, sizeof(path)) == 1);
+    ino_t written = inode_of(path);
+    
+    statepoint_table_t* table = generate(&map, &options);
+    check_adjacent_table(table);
+    CHECK(inode_of(path) == written);
+    destroy_table(table);
+    destroy_table(first);
+    
+    table = generate(&map, &options);
+    check_adjacent_table(table);
+    CHECK(inode_of(path) == written);
+    destroy_table(table);
+    
+    // a frame claiming more slots than the file holds is rejected, so the table is
+    // generated and written again.
+    size_t size;
+    uint8_t* bytes = read_file(path, &size);
+    frame_info_t* frame = find_frame_in_file(bytes, size, 0x10040);
+    CHECK(frame != NULL && frame->numSlots == 1);
+    frame->numSlots = 0x10000000;
+    write_file(path, bytes, size);
+    
+    table = generate(&map, &options);
+    check_adjacent_table(table);
+    CHECK(inode_of(path) != written);
+    written = inode_of(path);
+    destroy_table(table);
+    
+    // likewise for flags the library never sets, and for a truncated file.
+    frame->numSlots = 1;
+    frame->flags = 0x4;
+    write_file(path, bytes, size);
+    table = generate(&map, &options);
+    check_adjacent_table(table);
+    CHECK(inode_of(path) != written);
+    destroy_table(table);
+    
+    write_file(path, bytes, size / 2);
+    written = inode_of(path);
+    table = generate(&map, &options);
+    check_adjacent_table(table);
+    CHECK(inode_of(path) != written);
+    destroy_table(table);
+    free(bytes);
+    
+    // a table written without a namer isn't used with one, whose sizes differ.
+    symbol_t symbols[] = {
+        { 0x20000, 0x100, "f3" },
+        { 0, 0, NULL }
+    };
+    options.nameFunction = name_from_symbols;
+    options.namerContext = symbols;
+    table = generate(&map, &options);
+    check_adjacent_table(table);
+    CHECK(find_cached_tables(dir, path, sizeof(path)) == 2);
+    CHECK(function_start(table, 0x200FF) == 0x20000);
+    destroy_table(table);
+    options.nameFunction = NULL;
+    
+    // nor is the table of a stack map that has since changed.
+    stackmap_t changed;
+    init_stackmap(&changed);
+    emit_adjacent_functions(&changed);
+    uint64_t stackSize = 48;
+    memcpy(changed.bytes + 16 + 8, &stackSize, sizeof(uint64_t));
+    table = generate(&changed, &options);
+    CHECK(table != NULL && lookup_return_address(table, 0x10040)->frameSize == 48);
+    CHECK(find_cached_tables(dir, path, sizeof(path)) == 3);
+    destroy_table(table);
+    
+    while(find_cached_tables(dir, path, sizeof(path)) > 0) {
+        CHECK(unlink(path) == 0);
+    }
+    CHECK(rmdir(dir) == 0);
+    free(changed.bytes);
+    free(map.bytes);
+}
+
+
+/**** Captured stacks ****/
+
+void count_root(void** root, void* context) {
+    (void)root;
+    (*(uint64_t*)context)++;
+}
+
+void test_capture(void) {
+    char dir[] = "/tmp/statepoint-features-XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    char path[512];
+    snprintf(path, sizeof(path), "%s/stacks", dir);
+    
+    stackmap_t map;
+    init_stackmap(&map);
+    emit_adjacent_functions(&map);
+    table_options_t options;
+    default_table_options(&options);
+    statepoint_table_t* table = generate(&map, &options);
+    CHECK(table != NULL);
+    
+    // frames of 16, 32 and 16 bytes, then a word that isn't a return address.
+    uint64_t stack[12] = { 0x10040, 1, 2, 0x10050, 3, 4, 5, 6, 0x20008, 7, 8, 0 };
+    uint64_t retAddrs[3] = { 0x10040, 0x10050, 0x20008 };
+    uint64_t notAStack = 0x12345;
+    
+    stack_capture_t* capture = start_capture(table, path, CAPTURE_FRAMES);
+    CHECK(capture != NULL);
+    CHECK(capture_stack(capture, (uint8_t*)stack));
+    CHECK(capture_stack(capture, (uint8_t*)&notAStack));
+    CHECK(finish_capture(capture));
+    
+    captured_stacks_t* stacks = load_captured_stacks(path);
+    CHECK(stacks != NULL && stacks->flags == CAPTURE_FRAMES);
+    CHECK(stacks->sectionLength == map.length);
+    CHECK(memcmp(stacks->section, map.bytes, map.length) == 0);
+    CHECK(stacks->numStacks == 2);
+    
+    captured_stack_t* captured = stacks->stacks;
+    CHECK(captured->numFrames == 3);
+    CHECK(memcmp(captured->retAddrs, retAddrs, sizeof(retAddrs)) == 0);
+    CHECK(captured->stackSize == sizeof(stack));
+    CHECK(memcmp(captured->stack, stack, sizeof(stack)) == 0);
+    
+    // the replay walks the copy of the stack with a table of the captured section.
+    statepoint_table_t* replay = generate_table_with_options(stacks->section,
+                                                             stacks->sectionLength,
+                                                             &options);
+    CHECK(replay != NULL);
+    uint64_t numRoots = 0;
+    walk_stack(replay, captured->stack, count_root, &numRoots);
+    CHECK(numRoots == 3);
+    destroy_table(replay);
+    
+    captured = stacks->stacks + 1;
+    CHECK(captured->numFrames == 0);
+    CHECK(captured->stackSize == sizeof(uint64_t));
+    CHECK(*(uint64_t*)captured->stack == notAStack);
+    destroy_captured_stacks(stacks);
+    
+    // without CAPTURE_FRAMES, only the return addresses are kept.
+    capture = start_capture(table, path, 0);
+    CHECK(capture != NULL && capture_stack(capture, (uint8_t*)stack));
+    CHECK(finish_capture(capture));
+    stacks = load_captured_stacks(path);
+    CHECK(stacks != NULL && stacks->flags == 0 && stacks->numStacks == 1);
+    CHECK(stacks->stacks[0].numFrames == 3 && stacks->stacks[0].stack == NULL);
+    CHECK(stacks->stacks[0].stackSize == 0);
+    CHECK(memcmp(stacks->stacks[0].retAddrs, retAddrs, sizeof(retAddrs)) == 0);
+    destroy_captured_stacks(stacks);
+    
+    // a truncated file, or one of something else, is rejected.
+    size_t size;
+    uint8_t* bytes = read_file(path, &size);
+    write_file(path, bytes, size - 8);
+    CHECK(load_captured_stacks(path) == NULL);
+    bytes[0] = 'X';
+    write_file(path, bytes, size);
+    CHECK(load_captured_stacks(path) == NULL);
+    free(bytes);
+    
+    CHECK(unlink(path) == 0);
+    CHECK(load_captured_stacks(path) == NULL);
+    CHECK(rmdir(dir) == 0);
+    destroy_table(table);
+    free(map.bytes);
+}
+
+/**** Sampling stacks ****/
+
+// Copies the words to the end of the page before the guard page, and returns them.
+uint64_t* place_before(uint8_t* guard, const uint64_t* words, size_t numWords) {
+    uint64_t* placed = (uint64_t*)guard - numWords;
+    memcpy(placed, words, numWords * sizeof(uint64_t));
+    return placed;
+}
+
+void test_sample_stack(void) {
+    stackmap_t map;
+    init_stackmap(&map);
+    emit_adjacent_functions(&map);
+    table_options_t options;
+    default_table_options(&options);
+    statepoint_table_t* table = generate(&map, &options);
+    CHECK(table != NULL);
+    
+    // any read past stackEnd faults.
+    long pageSize = sysconf(_SC_PAGESIZE);
+    uint8_t* pages = mmap(NULL, 2 * pageSize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(pages != MAP_FAILED);
+    uint8_t* guard = pages + pageSize;
+    CHECK(mprotect(guard, pageSize, PROT_NONE) == 0);
+    
+    // two words of whatever was interrupted, then frames of 16, 32 and 16 bytes that
+    // end at the guard page.
+    uint64_t words[13] = { 0x99, 0x98, 0x10040, 1, 2, 0x10050, 3, 4, 5, 6, 0x20008, 7, 8 };
+    uint64_t* stack = place_before(guard, words, 13);
+    uint64_t retAddrs[8];
+    
+    CHECK(sample_stack(table, (uint8_t*)stack, guard, 16, retAddrs, 8) == 3);
+    CHECK(retAddrs[0] == 0x10040 && retAddrs[1] == 0x10050 && retAddrs[2] == 0x20008);
+    
+    // the scan for the first return address gives up after maxScan words.
+    CHECK(sample_stack(table, (uint8_t*)stack, guard, 2, retAddrs, 8) == 0);
+    CHECK(sample_stack(table, (uint8_t*)stack, guard, 3, retAddrs, 8) == 3);
+    
+    // at most maxFrames are sampled.
+    retAddrs[2] = 0;
+    CHECK(sample_stack(table, (uint8_t*)stack, guard, 16, retAddrs, 2) == 2);
+    CHECK(retAddrs[1] == 0x10050 && retAddrs[2] == 0);
+    CHECK(sample_stack(table, (uint8_t*)stack, guard, 16, retAddrs, 0) == 0);
+    
+    // an unaligned stackPtr starts at the next word.
+    CHECK(sample_stack(table, (uint8_t*)(stack + 1) + 3, guard, 16, retAddrs, 8) == 3);
+    CHECK(retAddrs[0] == 0x10040);
+    
+    // a stack cut off in the middle of a frame ends the walk at that frame, and one
+    // cut off in the middle of a word doesn't read it.
+    stack = place_before(guard, words, 8);
+    CHECK(sample_stack(table, (uint8_t*)stack, guard, 16, retAddrs, 8) == 2);
+    CHECK(retAddrs[1] == 0x10050);
+    stack = place_before(guard, words, 13);
+    CHECK(sample_stack(table, (uint8_t*)stack, guard - 4, 16, retAddrs, 8) == 3);
+    
+    // and there is nothing to sample of an empty stack.
+    CHECK(sample_stack(table, guard, guard, 16, retAddrs, 8) == 0);
+    CHECK(sample_stack(table, guard - 4, guard, 16, retAddrs, 8) == 0);
+    CHECK(sample_stack(table, guard, pages, 16, retAddrs, 8) == 0);
+    CHECK(sample_stack(NULL, (uint8_t*)stack, guard, 16, retAddrs, 8) == 0);
+    
+    CHECK(munmap(pages, 2 * pageSize) == 0);
+    destroy_table(table);
+    free(map.bytes);
+}
+
+int main(void) {
+    struct {
+        const char* name;
+        void (*run)(void);
+    } tests[] = {
+        { "function index", test_function_index },
+        { "statepoint IDs", test_statepoint_ids },
+        { "user data", test_user_data },
+        { "deopt state", test_deopt_state },
+        { "unusable roots", test_unusable_roots },
+        { "static roots", test_static_roots },
+        { "patchpoints", test_patchpoints },
+        { "sealed tables", test_sealed_tables },
+        { "table cache", test_cache },
+        { "captured stacks", test_capture },
+        { "sampled stacks", test_sample_stack },
+    };
+
+    for(size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        tests[i].run();
+        printf("features: %s ok\n", tests[i].name);
+    }
+    return 0;
+}
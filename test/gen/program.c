@@ -0,0 +1,207 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L     // for getopt
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+// for PRIu and PRId
+#define __STDC_FORMAT_MACROS 1
+#include <inttypes.h>
+
+/*
+   Writes the LLVM IR of a random program for the statepoint-example GC to stdout, to
+   be rewritten into statepoints by opt and compiled by llc, see the Makefile.
+
+   usage: program [-f functions] [-l max live objects per function]
+                  [-g max garbage objects per function] [-s seed] [-n name]
+
+   The program is a set of functions name_f0 ... name_fN-1 taking a depth and some
+   objects,
+
+     i64 @name_fI(i64 %n, obj %p0, ..., obj %pK)
+
+   Each allocates objects through @gc_alloc, which may collect, derives pointers into
+   some of them, allocates some garbage, and while %n > 0 calls a random function with %n - 1 and up to two
+   more with 0, with a "deopt" bundle of its own. After the calls, it folds the values
+   of every object it holds, read through the objects and the derived pointers, into
+   its result. So the program's result only depends on the depth it's started with,
+   and any root a collection fails to relocate changes it, see runtime.c.
+
+   Objects are laid out as { i64 forward, i64 value, obj next }, and @name(i64 depth)
+   starts the program. The name is "run" unless given, so programs with different
+   names can be linked together.
+*/
+
+#define OBJ "i64 addrspace(1)*"
+
+uint64_t rngState;
+
+uint64_t random_below(uint64_t n) {
+    // xorshift64
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return rngState % n;
+}
+
+typedef struct {
+    uint32_t numParams;
+} function_t;
+
+function_t* functions;
+uint32_t numFunctions;
+uint32_t maxLive;
+uint32_t maxGarbage;
+const char* name;
+
+// a call of function callee from the current function, whose live objects are %o0...
+// the arguments are picked at random from them.
+void print_call(uint32_t caller, uint32_t callee, const char* depth, uint32_t numLive,
+                uint32_t callIndex) {
+    printf("  %%r%" PRIu32 " = call i64 @%s_f%" PRIu32 "(i64 %s", callIndex, name, callee, depth);
+    for(uint32_t i = 0; i < functions[callee].numParams; i++) {
+        printf(", " OBJ " %%o%" PRIu64, random_below(numLive));
+    }
+
+    // the deopt state records where we are, and one of the objects.
+    printf(") [ \"deopt\"(i64 %%n, i32 %" PRIu32 ", i32 %" PRIu32 ", " OBJ " %%o%" PRIu64 ") ]\n",
+           caller, callIndex, random_below(numLive));
+}
+
+void print_function(uint32_t f) {
+    uint32_t numParams = functions[f].numParams;
+    printf("define i64 @%s_f%" PRIu32 "(i64 %%n", name, f);
+    for(uint32_t i = 0; i < numParams; i++) {
+        printf(", " OBJ " %%o%" PRIu32, i);
+    }
+    printf(") gc \"statepoint-example\" {\nentry:\n");
+
+    // the first objects are the parameters, each allocation links to a random earlier one.
+    uint32_t numAllocs = 1 + random_below(maxLive);
+    uint32_t numLive = numParams + numAllocs;
+    for(uint32_t i = numParams; i < numLive; i++) {
+        if(i == 0) {
+            printf("  %%o0 = call " OBJ " @gc_alloc(i64 %" PRIu64 ", " OBJ " null)\n",
+                   random_below(1000));
+        } else {
+            printf("  %%o%" PRIu32 " = call " OBJ " @gc_alloc(i64 %" PRIu64 ", " OBJ " %%o%" PRIu64 ")\n",
+                   i, random_below(1000), random_below(i));
+        }
+    }
+
+    // pointers derived from some objects, to their value field, live across the calls.
+    uint32_t numDerived = random_below(1 + numLive / 2);
+    for(uint32_t i = 0; i < numDerived; i++) {
+        printf("  %%d%" PRIu32 " = getelementptr i64, " OBJ " %%o%" PRIu64 ", i64 1\n",
+               i, random_below(numLive));
+    }
+
+    // garbage, allocated while all of the above are live.
+    uint32_t numGarbage = random_below(1 + maxGarbage);
+    for(uint32_t i = 0; i < numGarbage; i++) {
+        printf("  %%g%" PRIu32 " = call " OBJ " @gc_alloc(i64 0, " OBJ " null)\n", i);
+    }
+
+    printf("  %%leaf = icmp sle i64 %%n, 0\n");
+    printf("  br i1 %%leaf, label %%fold, label %%calls\n\ncalls:\n");
+    printf("  %%m = sub i64 %%n, 1\n");
+
+    uint32_t numCalls = 1 + random_below(3);
+    for(uint32_t c = 0; c < numCalls; c++) {
+        print_call(f, random_below(numFunctions), c == 0 ? "%m" : "0", numLive, c);
+    }
+    printf("  %%c0 = add i64 0, %%r0\n");
+    for(uint32_t c = 1; c < numCalls; c++) {
+        printf("  %%c%" PRIu32 " = add i64 %%c%" PRIu32 ", %%r%" PRIu32 "\n", c, c - 1, c);
+    }
+    printf("  br label %%fold\n\nfold:\n");
+    printf("  %%s0 = phi i64 [ 0, %%entry ], [ %%c%" PRIu32 ", %%calls ]\n", numCalls - 1);
+
+    // fold in the value of each object, and of the next object of those allocated here
+    // with one, then the values read through the derived pointers.
+    uint32_t s = 0;
+    for(uint32_t i = 0; i < numLive; i++) {
+        printf("  %%v%" PRIu32 ".p = getelementptr i64, " OBJ " %%o%" PRIu32 ", i64 1\n", i, i);
+        printf("  %%v%" PRIu32 " = load i64, " OBJ " %%v%" PRIu32 ".p\n", i, i);
+        printf("  %%s%" PRIu32 ".m = mul i64 %%s%" PRIu32 ", 31\n", s, s);
+        printf("  %%s%" PRIu32 " = add i64 %%s%" PRIu32 ".m, %%v%" PRIu32 "\n", s + 1, s, i);
+        s++;
+
+        if(i < numParams || i == 0) {
+            continue;
+        }
+        printf("  %%n%" PRIu32 ".p = getelementptr i64, " OBJ " %%o%" PRIu32 ", i64 2\n", i, i);
+        printf("  %%n%" PRIu32 ".q = bitcast " OBJ " %%n%" PRIu32 ".p to " OBJ " addrspace(1)*\n",
+               i, i);
+        printf("  %%n%" PRIu32 " = load " OBJ ", " OBJ " addrspace(1)* %%n%" PRIu32 ".q\n", i, i);
+        printf("  %%u%" PRIu32 ".p = getelementptr i64, " OBJ " %%n%" PRIu32 ", i64 1\n", i, i);
+        printf("  %%u%" PRIu32 " = load i64, " OBJ " %%u%" PRIu32 ".p\n", i, i);
+        printf("  %%s%" PRIu32 ".m = mul i64 %%s%" PRIu32 ", 7\n", s, s);
+        printf("  %%s%" PRIu32 " = add i64 %%s%" PRIu32 ".m, %%u%" PRIu32 "\n", s + 1, s, i);
+        s++;
+    }
+    for(uint32_t i = 0; i < numDerived; i++) {
+        printf("  %%w%" PRIu32 " = load i64, " OBJ " %%d%" PRIu32 "\n", i, i);
+        printf("  %%s%" PRIu32 ".m = mul i64 %%s%" PRIu32 ", 17\n", s, s);
+        printf("  %%s%" PRIu32 " = add i64 %%s%" PRIu32 ".m, %%w%" PRIu32 "\n", s + 1, s, i);
+        s++;
+    }
+    printf("  ret i64 %%s%" PRIu32 "\n}\n\n", s);
+}
+
+int main(int argc, char** argv) {
+    numFunctions = 200;
+    maxLive = 24;
+    maxGarbage = 32;
+    rngState = 1;
+    name = "run";
+
+    int opt;
+    while((opt = getopt(argc, argv, "f:l:g:s:n:")) != -1) {
+        switch(opt) {
+            case 'f': numFunctions = strtoul(optarg, NULL, 0); break;
+            case 'l': maxLive = strtoul(optarg, NULL, 0); break;
+            case 'g': maxGarbage = strtoul(optarg, NULL, 0); break;
+            case 's': rngState = strtoull(optarg, NULL, 0); break;
+            case 'n': name = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-f functions] [-l max live objects] "
+                                "[-g max garbage objects] [-s seed] [-n name]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if(numFunctions == 0 || maxLive == 0 || rngState == 0) {
+        fprintf(stderr, "program: need a function, a live object, and a nonzero seed\n");
+        return 1;
+    }
+
+    functions = malloc(numFunctions * sizeof(function_t));
+    for(uint32_t f = 0; f < numFunctions; f++) {
+        functions[f].numParams = random_below(5);
+    }
+
+    printf("; generated by: program -f %" PRIu32 " -l %" PRIu32 " -g %" PRIu32 "\n\n",
+           numFunctions, maxLive, maxGarbage);
+    printf("declare " OBJ " @gc_alloc(i64, " OBJ ")\n\n");
+
+    for(uint32_t f = 0; f < numFunctions; f++) {
+        print_function(f);
+    }
+
+    // @name calls name_f0 with objects of its own.
+    printf("define i64 @%s(i64 %%n) gc \"statepoint-example\" {\n", name);
+    printf("  %%o0 = call " OBJ " @gc_alloc(i64 1, " OBJ " null)\n");
+    printf("  %%r = call i64 @%s_f0(i64 %%n", name);
+    for(uint32_t i = 0; i < functions[0].numParams; i++) {
+        printf(", " OBJ " %%o0");
+    }
+    printf(")\n  ret i64 %%r\n}\n");
+
+    free(functions);
+    return 0;
+}
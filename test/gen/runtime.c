@@ -0,0 +1,282 @@
+#include "../../dist/llvm-statepoint-tablegen.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// for PRIu and PRId
+#define __STDC_FORMAT_MACROS 1
+#include <inttypes.h>
+
+/*
+   Runs two programs written by program.c under load, run and second, whose stack
+   maps are two blobs of one section: each thread runs both to the given depth, over
+   and over, in a semispace heap of its own that it collects with a copying GC
+   whenever an allocation doesn't fit. The roots are found by walk_stack_with_options
+   with the process-wide table, prefetching the objects with -p, and only visiting
+   those into the from-space with -f 1, and every frame's deopt state is looked up
+   along the way. The from-space is poisoned after each collection, so a missed root
+   changes the result, which must not depend on the size of the heap or how the roots
+   are found.
+
+   usage: runtime [-t threads] [-i iterations] [-d depth] [-h heap KiB per space]
+                  [-p prefetch distance] [-f filter walks, 0 or 1]
+
+   Prints the result of the programs, which the Makefile compares between runs with
+   heaps too small and too large to ever collect, with prefetching, and with
+   filtered walks.
+*/
+
+extern uint8_t __LLVM_StackMaps[];
+extern uint8_t __LLVM_StackMaps_end[];
+
+// generated, see program.c. Their stack maps are both in the section, see the Makefile.
+int64_t run(int64_t depth);
+int64_t second(int64_t depth);
+
+typedef struct object {
+    struct object* forward;
+    int64_t value;
+    struct object* next;
+} object_t;
+
+typedef struct {
+    uint8_t* fromSpace;
+    uint8_t* toSpace;
+    uint8_t* top;       // the first free byte of fromSpace
+    uint8_t* scan;      // the first object in toSpace yet to be scanned
+    size_t spaceSize;
+
+    uint64_t numGCs;
+    uint64_t numFrames;
+    uint64_t numDeoptFrames;
+    uint64_t maxFrames;
+} heap_t;
+
+__thread heap_t heap;
+
+size_t spaceSize = 1 << 20;
+int64_t depth = 200;
+uint64_t iterations = 20;
+walk_options_t walkOptions;
+bool filterWalks = false;
+
+bool in_from_space(object_t* obj) {
+    return (uint8_t*)obj >= heap.fromSpace && (uint8_t*)obj < heap.fromSpace + heap.spaceSize;
+}
+
+object_t* copy_object(object_t* obj) {
+    if(obj == NULL || !in_from_space(obj)) {
+        return obj;
+    }
+    if(obj->forward == NULL) {
+        object_t* copy = (object_t*)heap.top;
+        heap.top += sizeof(object_t);
+        memcpy(copy, obj, sizeof(object_t));
+        obj->forward = copy;
+    }
+    return obj->forward;
+}
+
+void relocate_root(void** root, void* context) {
+    (*(uint64_t*)context)++;
+    *root = copy_object((object_t*)*root);
+}
+
+void count_root(void** root, void* context) {
+    (void)root;
+    (*(uint64_t*)context)++;
+}
+
+// Relocates the roots like a minor collection would, with a walk that only visits the
+// roots into fromSpace. The roots outside of it are visited by another walk first,
+// and both must add up to every root.
+void relocate_filtered(statepoint_table_t* table, uint8_t* stackPtr) {
+    uint64_t numRoots = 0;
+    walk_stack(table, stackPtr, count_root, &numRoots);
+
+    uintptr_t start = (uintptr_t)heap.fromSpace;
+    uintptr_t end = start + heap.spaceSize;
+    address_range_t outside[2] = { { 0, start }, { end, UINTPTR_MAX } };
+    address_range_t inside = { start, end };
+
+    walk_options_t options = walkOptions;
+    uint64_t numOutside = 0;
+    options.ranges = outside;
+    options.numRanges = 2;
+    walk_stack_with_options(table, stackPtr, count_root, &numOutside, &options);
+
+    uint64_t numInside = 0;
+    options.ranges = &inside;
+    options.numRanges = 1;
+    walk_stack_with_options(table, stackPtr, relocate_root, &numInside, &options);
+
+    if(numOutside + numInside != numRoots) {
+        fprintf(stderr, "runtime: the filtered walks visited %" PRIu64 " + %" PRIu64
+                        " roots rather than %" PRIu64 "\n", numOutside, numInside, numRoots);
+        exit(1);
+    }
+}
+
+void collect(uint8_t* stackPtr, object_t** extraRoot) {
+    // copy_object copies the objects in fromSpace to the top of toSpace.
+    heap.top = heap.toSpace;
+    heap.scan = heap.toSpace;
+
+    statepoint_table_t* table = global_table();
+
+    // see Figure 1 in the header
+    uint64_t numFrames = 0;
+    uint8_t* cur = stackPtr;
+    frame_info_t* frame = lookup_return_address(table, *(uint64_t*)cur);
+    while(frame != NULL) {
+        if(lookup_deopt_state(table, *(uint64_t*)cur) != NULL) {
+            heap.numDeoptFrames++;
+        }
+        numFrames++;
+        cur += sizeof(void*) + frame->frameSize;
+        frame = lookup_return_address(table, *(uint64_t*)cur);
+    }
+    heap.numFrames += numFrames;
+    if(numFrames > heap.maxFrames) {
+        heap.maxFrames = numFrames;
+    }
+
+    uint64_t numRoots = 0;
+    if(filterWalks) {
+        relocate_filtered(table, stackPtr);
+    } else {
+        walk_stack_with_options(table, stackPtr, relocate_root, &numRoots, &walkOptions);
+    }
+    *extraRoot = copy_object(*extraRoot);
+
+    // Cheney's scan of the copies
+    while(heap.scan < heap.top) {
+        object_t* obj = (object_t*)heap.scan;
+        obj->forward = NULL;
+        obj->next = copy_object(obj->next);
+        heap.scan += sizeof(object_t);
+    }
+
+    memset(heap.fromSpace, 0x7F, heap.spaceSize);
+    uint8_t* oldSpace = heap.fromSpace;
+    heap.fromSpace = heap.toSpace;
+    heap.toSpace = oldSpace;
+    heap.numGCs++;
+}
+
+// gc_alloc(value, next) calls alloc_object(value, next, stackPtr), where stackPtr
+// points to the return address into the managed caller.
+__asm__(
+    "    .text\n"
+    "    .globl gc_alloc\n"
+    "gc_alloc:\n"
+    "    mov %rsp, %rdx\n"
+    "    jmp alloc_object\n"
+);
+
+object_t* alloc_object(int64_t value, object_t* next, uint8_t* stackPtr) {
+    if(heap.top + sizeof(object_t) > heap.fromSpace + heap.spaceSize) {
+        collect(stackPtr, &next);
+        if(heap.top + sizeof(object_t) > heap.fromSpace + heap.spaceSize) {
+            fprintf(stderr, "runtime: out of memory, use a larger heap\n");
+            exit(1);
+        }
+    }
+
+    object_t* obj = (object_t*)heap.top;
+    heap.top += sizeof(object_t);
+    obj->forward = NULL;
+    obj->value = value;
+    obj->next = next;
+    return obj;
+}
+
+void* run_thread(void* arg) {
+    heap.spaceSize = spaceSize;
+    heap.fromSpace = malloc(spaceSize);
+    heap.toSpace = malloc(spaceSize);
+    assert(heap.fromSpace && heap.toSpace && "bad alloc");
+    heap.top = heap.fromSpace;
+
+    int64_t* result = (int64_t*)arg;
+    for(uint64_t i = 0; i < iterations; i++) {
+        int64_t r = run(depth) * 31 + second(depth);
+        if(i > 0 && r != *result) {
+            fprintf(stderr, "runtime: iteration %" PRIu64 " gave a different result\n", i);
+            exit(1);
+        }
+        *result = r;
+
+        // start over with an empty heap
+        heap.top = heap.fromSpace;
+    }
+
+    fprintf(stderr, "runtime: %" PRIu64 " GCs, %" PRIu64 " frames walked, %" PRIu64
+                    " with deopt state, %" PRIu64 " at most\n",
+            heap.numGCs, heap.numFrames, heap.numDeoptFrames, heap.maxFrames);
+
+    free(heap.fromSpace);
+    free(heap.toSpace);
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    uint64_t numThreads = 4;
+    default_walk_options(&walkOptions);
+    for(int i = 1; i + 1 < argc; i += 2) {
+        uint64_t value = strtoull(argv[i + 1], NULL, 0);
+        if(strcmp(argv[i], "-t") == 0) {
+            numThreads = value;
+        } else if(strcmp(argv[i], "-i") == 0) {
+            iterations = value;
+        } else if(strcmp(argv[i], "-d") == 0) {
+            depth = value;
+        } else if(strcmp(argv[i], "-h") == 0) {
+            spaceSize = value << 10;
+        } else if(strcmp(argv[i], "-p") == 0) {
+            walkOptions.prefetchDistance = value;
+        } else if(strcmp(argv[i], "-f") == 0) {
+            filterWalks = value != 0;
+        } else {
+            fprintf(stderr, "usage: %s [-t threads] [-i iterations] [-d depth] "
+                            "[-h heap KiB] [-p prefetch distance] [-f 0|1]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(numThreads == 0 || spaceSize < sizeof(object_t)) {
+        fprintf(stderr, "runtime: need a thread and room for an object\n");
+        return 1;
+    }
+
+    table_options_t options;
+    default_table_options(&options);
+    init_global_table(__LLVM_StackMaps, __LLVM_StackMaps_end - __LLVM_StackMaps, &options);
+
+    pthread_t* threads = malloc(numThreads * sizeof(pthread_t));
+    int64_t* results = calloc(numThreads, sizeof(int64_t));
+    assert(threads && results && "bad alloc");
+    for(uint64_t i = 0; i < numThreads; i++) {
+        if(pthread_create(threads + i, NULL, run_thread, results + i) != 0) {
+            fprintf(stderr, "runtime: can't create a thread\n");
+            return 1;
+        }
+    }
+    for(uint64_t i = 0; i < numThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for(uint64_t i = 1; i < numThreads; i++) {
+        if(results[i] != results[0]) {
+            fprintf(stderr, "runtime: threads gave different results\n");
+            return 1;
+        }
+    }
+    printf("result = %" PRId64 "\n", results[0]);
+
+    free(threads);
+    free(results);
+    destroy_global_table();
+    return 0;
+}
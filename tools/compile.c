@@ -0,0 +1,461 @@
+/**
+ * llvm-statepoint-compile: compiles the stack maps of a linked program into C code.
+ *
+ * usage: llvm-statepoint-compile <program> <output> [prefix]
+ *
+ * Writes <output>.c and <output>.h. The C file holds every frame of the program as
+ * static const data, along with lookup functions that search the sorted keys with
+ * a fixed number of steps, so there is nothing to generate when the program starts.
+ *
+ * Frames with the same slots share a scanning routine, which visits their roots with
+ * straight-line code. Frames are tagged with the routine's number (their shape), and
+ * the generated scan function dispatches on it with a switch. Pointers to the routines
+ * would need relocating when the program is loaded, see emit_frame.
+ *
+ * Keys are return addresses relative to the load address of the program, like the
+ * keyBase of a cached table. The generated code must be linked into the same program
+ * as the last object file, so that none of the callsites move: build the program
+ * once, run this on it, then link it again with the output.
+ */
+
+#include "../src/include/api.h"
+#include "../src/include/hash_table.h"
+
+#include <elf.h>
+
+void fail(const char* message, const char* detail) {
+    fprintf(stderr, "llvm-statepoint-compile: %s %s\n", message, detail);
+    exit(1);
+}
+
+uint8_t* read_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if(file == NULL) {
+        fail("couldn't open", path);
+    }
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t* data = malloc(length > 0 ? length : 1);
+    if(data == NULL || length < 0 || fread(data, 1, length, file) != (size_t)length) {
+        fail("couldn't read", path);
+    }
+    fclose(file);
+
+    *size = length;
+    return data;
+}
+
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    Elf64_Ehdr* header;
+    Elf64_Shdr* sections;
+} elf_file_t;
+
+// The section, checked to be within the file.
+uint8_t* section_data(elf_file_t* elf, Elf64_Shdr* section) {
+    if(section->sh_type == SHT_NOBITS || section->sh_offset > elf->size
+                                      || section->sh_size > elf->size - section->sh_offset) {
+        fail("section runs past the end of the file", "");
+    }
+    return elf->data + section->sh_offset;
+}
+
+Elf64_Shdr* find_section(elf_file_t* elf, const char* name) {
+    Elf64_Shdr* names = elf->sections + elf->header->e_shstrndx;
+    const char* strings = (const char*)section_data(elf, names);
+
+    for(uint16_t i = 0; i < elf->header->e_shnum; i++) {
+        if(elf->sections[i].sh_name < names->sh_size
+                && strcmp(strings + elf->sections[i].sh_name, name) == 0) {
+            return elf->sections + i;
+        }
+    }
+    return NULL;
+}
+
+void open_elf(elf_file_t* elf, const char* path) {
+    elf->data = read_file(path, &elf->size);
+    elf->header = (Elf64_Ehdr*)elf->data;
+
+    Elf64_Ehdr* header = elf->header;
+    if(elf->size < sizeof(Elf64_Ehdr) || memcmp(header->e_ident, ELFMAG, SELFMAG) != 0
+                                      || header->e_ident[EI_CLASS] != ELFCLASS64
+                                      || header->e_ident[EI_DATA] != ELFDATA2LSB) {
+        fail("not a 64-bit little endian ELF file:", path);
+    }
+
+    if(header->e_type != ET_EXEC && header->e_type != ET_DYN) {
+        fail("not a linked program or library:", path);
+    }
+
+    if(header->e_shoff > elf->size
+            || header->e_shnum > (elf->size - header->e_shoff) / sizeof(Elf64_Shdr)
+            || header->e_shstrndx >= header->e_shnum) {
+        fail("malformed section headers in", path);
+    }
+    elf->sections = (Elf64_Shdr*)(elf->data + header->e_shoff);
+}
+
+// The address the ELF header is loaded at, relative to the load address.
+uint64_t header_address(elf_file_t* elf) {
+    Elf64_Ehdr* header = elf->header;
+    if(header->e_phoff > elf->size
+            || header->e_phnum > (elf->size - header->e_phoff) / sizeof(Elf64_Phdr)) {
+        fail("malformed program headers", "");
+    }
+
+    Elf64_Phdr* segments = (Elf64_Phdr*)(elf->data + header->e_phoff);
+    for(uint16_t i = 0; i < header->e_phnum; i++) {
+        if(segments[i].p_type == PT_LOAD && segments[i].p_offset == 0) {
+            return segments[i].p_vaddr;
+        }
+    }
+    fail("the ELF header is not loaded", "");
+    return 0;
+}
+
+// In position independent programs, the function addresses in the stack maps are
+// filled in by relative relocations, whose addends are the addresses we want.
+void apply_relocations(elf_file_t* elf, Elf64_Shdr* stackmaps, uint8_t* data) {
+    uint32_t relative = elf->header->e_machine == EM_AARCH64 ? R_AARCH64_RELATIVE
+                                                            : R_X86_64_RELATIVE;
+
+    for(uint16_t i = 0; i < elf->header->e_shnum; i++) {
+        Elf64_Shdr* section = elf->sections + i;
+        if(section->sh_type != SHT_RELA || section->sh_entsize != sizeof(Elf64_Rela)) {
+            continue;
+        }
+
+        Elf64_Rela* relocs = (Elf64_Rela*)section_data(elf, section);
+        uint64_t numRelocs = section->sh_size / sizeof(Elf64_Rela);
+        for(uint64_t k = 0; k < numRelocs; k++) {
+            uint64_t offset = relocs[k].r_offset - stackmaps->sh_addr;
+            if(relocs[k].r_offset < stackmaps->sh_addr || offset >= stackmaps->sh_size) {
+                continue;
+            }
+
+            if(ELF64_R_TYPE(relocs[k].r_info) != relative
+                    || offset > stackmaps->sh_size - sizeof(uint64_t)) {
+                fail("unsupported relocation in the stack map section", "");
+            }
+            memcpy(data + offset, &relocs[k].r_addend, sizeof(uint64_t));
+        }
+    }
+}
+
+int compare_frames(const void* a, const void* b) {
+    uint64_t x = (*(frame_info_t* const*)a)->retAddr;
+    uint64_t y = (*(frame_info_t* const*)b)->retAddr;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Returns the frames of the table, sorted by return address.
+frame_info_t** sorted_frames(statepoint_table_t* table, uint64_t* numFrames) {
+    uint64_t count = 0;
+    for(uint64_t i = 0; i < table->size; i++) {
+        count += table->buckets[i].numEntries;
+    }
+
+    frame_info_t** frames = malloc((count + 1) * sizeof(frame_info_t*));
+    if(frames == NULL) {
+        fail("out of memory", "");
+    }
+
+    uint64_t k = 0;
+    for(uint64_t i = 0; i < table->size; i++) {
+        frame_info_t* entry = table->buckets[i].entries;
+        for(uint32_t j = 0; j < table->buckets[i].numEntries; j++) {
+            frames[k++] = entry;
+            entry = next_frame(entry);
+        }
+    }
+
+    qsort(frames, count, sizeof(frame_info_t*), compare_frames);
+    *numFrames = count;
+    return frames;
+}
+
+// Frames with more slots are scanned by the generic scan_frame, to bound code size.
+#define MAX_UNROLLED_SLOTS 128
+
+int compare_shapes(const void* a, const void* b) {
+    frame_info_t* x = *(frame_info_t* const*)a;
+    frame_info_t* y = *(frame_info_t* const*)b;
+    if(x->numSlots != y->numSlots) {
+        return x->numSlots < y->numSlots ? -1 : 1;
+    }
+    return memcmp(x->slots, y->slots, x->numSlots * sizeof(pointer_slot_t));
+}
+
+// Numbers the distinct shapes of the frames from 1, setting the shape of each frame.
+// Returns an example frame of each shape, indexed by shape, and their number.
+frame_info_t** assign_shapes(frame_info_t** frames, uint64_t numFrames, uint16_t* numShapes) {
+    frame_info_t** sorted = malloc((numFrames + 1) * sizeof(frame_info_t*));
+    frame_info_t** shapes = malloc((UINT16_MAX + 1) * sizeof(frame_info_t*));
+    if(sorted == NULL || shapes == NULL) {
+        fail("out of memory", "");
+    }
+    memcpy(sorted, frames, numFrames * sizeof(frame_info_t*));
+    qsort(sorted, numFrames, sizeof(frame_info_t*), compare_shapes);
+
+    uint16_t count = 0;
+    for(uint64_t i = 0; i < numFrames; i++) {
+        frame_info_t* frame = sorted[i];
+        if(frame->numSlots > MAX_UNROLLED_SLOTS) {
+            frame->shape = 0;
+            continue;
+        }
+
+        bool sameShape = count > 0 && compare_shapes(&shapes[count], &frame) == 0;
+        if(!sameShape && count < UINT16_MAX) {
+            shapes[++count] = frame;
+            sameShape = true;
+        }
+        frame->shape = sameShape ? count : 0;
+    }
+
+    free(sorted);
+    *numShapes = count;
+    return shapes;
+}
+
+FILE* open_output(const char* base, const char* extension) {
+    size_t length = strlen(base) + strlen(extension) + 1;
+    char* path = malloc(length);
+    if(path == NULL) {
+        fail("out of memory", "");
+    }
+    snprintf(path, length, "%s%s", base, extension);
+
+    FILE* out = fopen(path, "w");
+    if(out == NULL) {
+        fail("couldn't write", path);
+    }
+    free(path);
+    return out;
+}
+
+void emit_header(FILE* out, const char* program, const char* prefix) {
+    fprintf(out, "/* Generated by llvm-statepoint-compile from %s. Do not edit. */\n\n", program);
+    fprintf(out, "#ifndef __%s_FRAMES__\n#define __%s_FRAMES__\n\n", prefix, prefix);
+    fprintf(out, "#include \"llvm-statepoint-tablegen.h\"\n\n");
+    fprintf(out, "#ifdef __cplusplus\n  extern \"C\" {\n#endif\n\n");
+    fprintf(out, "// the frame of a return address relative to the program's load address\n");
+    fprintf(out, "frame_info_t* %s_lookup_offset(uint64_t offset);\n\n", prefix);
+    fprintf(out, "// same as lookup_return_address\n");
+    fprintf(out, "frame_info_t* %s_lookup_return_address(uint64_t retAddr);\n\n", prefix);
+    fprintf(out, "// same as scan_frame, but with the frame's own scanning routine\n");
+    fprintf(out, "void %s_scan_frame(frame_info_t* frame, uint8_t* base, "
+                 "root_visitor_t visit, void* context);\n\n", prefix);
+    fprintf(out, "// same as walk_stack, with the frames and routines above\n");
+    fprintf(out, "void %s_walk_stack(uint8_t* stackPtr, root_visitor_t visit, "
+                 "void* context);\n\n", prefix);
+    fprintf(out, "#ifdef __cplusplus\n  } /* end of extern C */\n#endif\n\n");
+    fprintf(out, "#endif\n");
+}
+
+// frames are members of one struct, so that they can be found by their offset into
+// it. an array of pointers would need relocating when the program is loaded, and
+// those relocations come before the code, moving it.
+void emit_frame(FILE* out, frame_info_t* frame, uint64_t index) {
+    fprintf(out, "    FRAME_TYPE(%" PRIu32 ") frame_%" PRIu64 ";\n",
+            frame->numSlots > 0 ? frame->numSlots : 1, index);
+}
+
+void emit_frame_value(FILE* out, frame_info_t* frame) {
+    fprintf(out, "    { 0x%" PRIX64 ", %" PRIu64 ", %" PRIu32 ", 0, %" PRIu16 ", {",
+            frame->retAddr, frame->frameSize, frame->numSlots, frame->shape);
+    for(uint32_t i = 0; i < frame->numSlots; i++) {
+        fprintf(out, "%s{%" PRId32 ", %" PRId32 "}", i == 0 ? "" : ", ",
+                frame->slots[i].kind, frame->slots[i].offset);
+    }
+    fprintf(out, frame->numSlots > 0 ? "} }" : "{0, 0}} }");
+}
+
+// moves a derived pointer between its address and its offset from the base, op
+// being + or -, see scan_frame.
+void emit_derived(FILE* out, frame_info_t* frame, pointer_slot_t* slot, char op) {
+    fprintf(out, "    *(uintptr_t*)(base + %" PRId32 ") %c= *(uintptr_t*)(base + %" PRId32 ");\n",
+            slot->offset, op, frame->slots[slot->kind].offset);
+}
+
+void emit_scan_routine(FILE* out, frame_info_t* frame) {
+    fprintf(out, "static void scan_shape_%" PRIu16 "(uint8_t* base, root_visitor_t visit, "
+                 "void* context) {\n", frame->shape);
+    fprintf(out, "    (void)base; (void)visit; (void)context;\n");
+
+    for(uint32_t i = 0; i < frame->numSlots; i++) {
+        if(frame->slots[i].kind >= 0) {
+            emit_derived(out, frame, frame->slots + i, '-');
+        }
+    }
+    for(uint32_t i = 0; i < frame->numSlots; i++) {
+        if(frame->slots[i].kind < 0) {
+            fprintf(out, "    visit((void**)(base + %" PRId32 "), context);\n",
+                    frame->slots[i].offset);
+        }
+    }
+    for(uint32_t i = 0; i < frame->numSlots; i++) {
+        if(frame->slots[i].kind >= 0) {
+            emit_derived(out, frame, frame->slots + i, '+');
+        }
+    }
+    fprintf(out, "}\n\n");
+}
+
+void emit_scanning(FILE* out, const char* prefix, frame_info_t** shapes, uint16_t numShapes) {
+    for(uint16_t i = 1; i <= numShapes; i++) {
+        emit_scan_routine(out, shapes[i]);
+    }
+
+    fprintf(out, "void %s_scan_frame(frame_info_t* frame, uint8_t* base, "
+                 "root_visitor_t visit, void* context) {\n", prefix);
+    fprintf(out, "    switch(frame->shape) {\n");
+    for(uint16_t i = 1; i <= numShapes; i++) {
+        fprintf(out, "        case %" PRIu16 ": scan_shape_%" PRIu16
+                     "(base, visit, context); return;\n", i, i);
+    }
+    fprintf(out, "        default: scan_frame(frame, base, visit, context); return;\n");
+    fprintf(out, "    }\n}\n\n");
+
+    fprintf(out, "void %s_walk_stack(uint8_t* stackPtr, root_visitor_t visit, "
+                 "void* context) {\n", prefix);
+    fprintf(out, "    frame_info_t* frame = %s_lookup_return_address(*(uint64_t*)stackPtr);\n",
+            prefix);
+    fprintf(out, "    while(frame != NULL) {\n");
+    fprintf(out, "        uint8_t* base = stackPtr + sizeof(void*);\n");
+    fprintf(out, "        %s_scan_frame(frame, base, visit, context);\n", prefix);
+    fprintf(out, "        stackPtr = base + frame->frameSize;\n");
+    fprintf(out, "        frame = %s_lookup_return_address(*(uint64_t*)stackPtr);\n", prefix);
+    fprintf(out, "    }\n}\n");
+}
+
+void emit_source(FILE* out, const char* program, const char* prefix,
+                 frame_info_t** frames, uint64_t numFrames, uint64_t headerAddress) {
+    uint16_t numShapes;
+    frame_info_t** shapes = assign_shapes(frames, numFrames, &numShapes);
+
+    fprintf(out, "/* Generated by llvm-statepoint-compile from %s. Do not edit. */\n\n", program);
+    fprintf(out, "#include <stddef.h>\n#include <stdint.h>\n");
+    fprintf(out, "#include \"llvm-statepoint-tablegen.h\"\n\n");
+
+    // frames are laid out like frame_info_t, with a fixed number of slots.
+    fprintf(out, "#define FRAME_TYPE(N) struct { uint64_t retAddr; uint64_t frameSize; "
+                 "uint32_t numSlots; uint16_t flags; uint16_t shape; "
+                 "pointer_slot_t slots[N]; }\n\n");
+    fprintf(out, "typedef char frame_layout_check[offsetof(FRAME_TYPE(1), slots) "
+                 "== offsetof(frame_info_t, slots) ? 1 : -1];\n\n");
+
+    // an empty program still gets a frame and a key, which can never match.
+    fprintf(out, "#define NUM_FRAMES %" PRIu64 "\n\n", numFrames);
+    fprintf(out, "static const struct all_frames {\n");
+    for(uint64_t i = 0; i < numFrames; i++) {
+        emit_frame(out, frames[i], i);
+    }
+    fprintf(out, numFrames > 0 ? "} allFrames = {\n" : "    FRAME_TYPE(1) unused;\n"
+                                                       "} allFrames = {\n    {0}");
+    for(uint64_t i = 0; i < numFrames; i++) {
+        emit_frame_value(out, frames[i]);
+        fprintf(out, i + 1 < numFrames ? ",\n" : "");
+    }
+    fprintf(out, "\n};\n\n");
+
+    uint64_t maxKey = numFrames > 0 ? frames[numFrames - 1]->retAddr : 0;
+    const char* keyType = maxKey <= UINT32_MAX ? "uint32_t" : "uint64_t";
+    uint64_t numKeys = numFrames > 0 ? numFrames : 1;
+
+    fprintf(out, "static const %s keys[%" PRIu64 "] = {", keyType, numKeys);
+    for(uint64_t i = 0; i < numFrames; i++) {
+        fprintf(out, "%s0x%" PRIX64 "%s", (i % 8 == 0) ? "\n    " : " ",
+                frames[i]->retAddr, i + 1 < numFrames ? "," : "");
+    }
+    fprintf(out, numFrames > 0 ? "\n};\n\n" : "0 };\n\n");
+
+    fprintf(out, "static const uint32_t offsets[%" PRIu64 "] = {", numKeys);
+    for(uint64_t i = 0; i < numFrames; i++) {
+        fprintf(out, "%soffsetof(struct all_frames, frame_%" PRIu64 ")%s",
+                (i % 4 == 0) ? "\n    " : " ", i, i + 1 < numFrames ? "," : "");
+    }
+    fprintf(out, numFrames > 0 ? "\n};\n\n" : "0 };\n\n");
+
+    // NUM_FRAMES is a constant, so the compiler fully unrolls the search, and the
+    // conditional move in each step leaves no branches to mispredict.
+    fprintf(out, "frame_info_t* %s_lookup_offset(uint64_t offset) {\n", prefix);
+    fprintf(out, "    if(NUM_FRAMES == 0 || offset > 0x%" PRIX64 ") {\n", maxKey);
+    fprintf(out, "        return NULL;\n    }\n\n");
+    fprintf(out, "    const %s key = (%s)offset;\n", keyType, keyType);
+    fprintf(out, "    size_t lo = 0;\n");
+    fprintf(out, "    for(size_t n = NUM_FRAMES; n > 1; n -= n / 2) {\n");
+    fprintf(out, "        lo = keys[lo + n / 2] <= key ? lo + n / 2 : lo;\n    }\n\n");
+    fprintf(out, "    if(keys[lo] != key) {\n        return NULL;\n    }\n");
+    fprintf(out, "    return (frame_info_t*)((const char*)&allFrames + offsets[lo]);\n}\n\n");
+
+    // the linker defines __ehdr_start at the ELF header, which tells us where the
+    // program was loaded.
+    fprintf(out, "extern const char __ehdr_start[] __attribute__((visibility(\"hidden\")));\n\n");
+    fprintf(out, "frame_info_t* %s_lookup_return_address(uint64_t retAddr) {\n", prefix);
+    fprintf(out, "    uint64_t base = (uint64_t)(uintptr_t)__ehdr_start - 0x%" PRIX64 ";\n",
+            headerAddress);
+    fprintf(out, "    return %s_lookup_offset(retAddr - base);\n}\n\n", prefix);
+
+    emit_scanning(out, prefix, shapes, numShapes);
+    free(shapes);
+}
+
+void emit_files(const char* output, const char* program, const char* prefix,
+                frame_info_t** frames, uint64_t numFrames, uint64_t headerAddress) {
+    FILE* source = open_output(output, ".c");
+    emit_source(source, program, prefix, frames, numFrames, headerAddress);
+    fclose(source);
+
+    FILE* header = open_output(output, ".h");
+    emit_header(header, program, prefix);
+    fclose(header);
+}
+
+int main(int argc, char** argv) {
+    if(argc < 3 || argc > 4) {
+        fprintf(stderr, "usage: llvm-statepoint-compile <program> <output> [prefix]\n");
+        fprintf(stderr, "       llvm-statepoint-compile --empty <output> [prefix]\n");
+        return 1;
+    }
+    const char* program = argv[1];
+    const char* prefix = argc == 4 ? argv[3] : "statepoint";
+
+    // the first link of a program needs some table to link against. only code
+    // that comes before the table must not move, so an empty one will do.
+    if(strcmp(program, "--empty") == 0) {
+        emit_files(argv[2], "nothing", prefix, NULL, 0, 0);
+        return 0;
+    }
+
+    elf_file_t elf;
+    open_elf(&elf, program);
+
+    Elf64_Shdr* stackmaps = find_section(&elf, ".llvm_stackmaps");
+    if(stackmaps == NULL) {
+        fail("no stack maps in", program);
+    }
+
+    uint8_t* section = section_data(&elf, stackmaps);
+    apply_relocations(&elf, stackmaps, section);
+
+    // addresses in the file are relative to the load address already.
+    statepoint_table_t* table = generate_table_from_section(section, stackmaps->sh_size, 0.5);
+    if(table == NULL) {
+        fail("malformed stack maps in", program);
+    }
+
+    uint64_t numFrames;
+    frame_info_t** frames = sorted_frames(table, &numFrames);
+    emit_files(argv[2], program, prefix, frames, numFrames, header_address(&elf));
+
+    free(frames);
+    destroy_table(table);
+    free(elf.data);
+    return 0;
+}